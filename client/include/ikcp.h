@@ -269,6 +269,18 @@ struct IKCPSEG
 
 typedef IUINT32 kcp_conv_t;
 
+//---------------------------------------------------------------------
+// IKCPVEC: one buffer of a scatter-gather send
+//---------------------------------------------------------------------
+struct IKCPVEC
+{
+	const char *data;
+	int len;
+};
+
+typedef struct IKCPVEC ikcpvec;
+
+
 //---------------------------------------------------------------------
 // IKCPCB
 //---------------------------------------------------------------------
@@ -339,6 +351,10 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len);
 // user/upper level send, returns below zero for error
 int ikcp_send(ikcpcb *kcp, const char *buffer, int len);
 
+// scatter-gather send: the 'count' buffers are sent as one message and
+// fragmented straight into segments, without joining them first
+int ikcp_sendv(ikcpcb *kcp, const ikcpvec *vec, int count);
+
 // update state (call it repeatedly, every 10ms-100ms), or you can ask 
 // ikcp_check when to call it again (without ikcp_input/_send calling).
 // 'current' - current timestamp in millisec. 
@@ -2,6 +2,7 @@
 
 #include "util.h"
 #include <memory>
+#include <sys/uio.h>
 
 namespace KCP
 {
@@ -18,13 +19,20 @@ namespace KCP
 
         // 设置上层回调，进行事件通知
         void set_event_callback(const client_event_callback_t& event_callback_func, void* var);
-        // 请求建立kcp连接；当失败会通过run回调给上层，上层重新调用这个函数请求连接,，建立kcp连接
+        // 请求建立kcp连接；当失败会通过run回调给上层，上层重新调用这个函数请求连接,，建立kcp连接；
+        // 被服务端断开后再次调用会回收旧会话，必要时重建套接字，重新握手
         int connect();
+        // 断线（网络切换等）后用新套接字恢复原会话，kcp 状态和未确认数据保留，恢复包后立即重传不等往返；
+        // 服务端拒绝时回调 eDisconnect，上层改为重新 connect。
+        // connect/resume/exit 需要回收收发线程，只能在应用线程调用，事件回调中调用返回 KCP_ERR_IN_CALLBACK
+        int resume();
         // 结束 kcp 连接
         void exit();
 
         // 应用层直接调用，通过kcp发送数据
         void send(const std::string& msg);
+        // 分散发送：iov 的各段（如消息头、消息体、消息尾）作为一条消息直接分片进 kcp，不用先拼接
+        int sendv(const struct iovec* iov, int iovcnt);
 
     private:
         std::unique_ptr<Session> session_;
@@ -11,12 +11,24 @@ const int SERVER_PORT{12345};
 // kcp 发送最低时间间隔
 const int KCP_UPDATE_INTERVAL{5}; // ms
 const int MAX_MSG_SIZE{1024 * 10}; // 10KB
+const int KCP_SENDV_INLINE{8};      // sendv 不超过这么多段时在栈上转换成 ikcpvec，更多段才分配
 
 
-const std::string KCP_CONNECT_PACKET("kcp_connection_packet");
-const uint32_t NOT_KCP_CONNECT_PACK{2^32-1};
-const std::string KCP_SEND_CONV_PACKET("kcp_connection_back_packet conv:");
-const std::string KCP_DISCONNECT_PACKET("kcp_disconnect_packet");
+const int KCP_CONNECT_TIMEOUT{3000}; // ms 等待握手完成的最长时间
+// 空闲（没有发出任何包）满 KCP_KEEPALIVE_INTERVAL 时发一个 kcp 窗口探测（WASK）保活，服务端回 WINS；
+// 超过 KCP_KEEPALIVE_TIMEOUT 没有收到服务端任何包，回调 eDisconnect
+const uint32_t KCP_KEEPALIVE_INTERVAL{1000*10}; // ms
+const uint32_t KCP_KEEPALIVE_TIMEOUT{KCP_KEEPALIVE_INTERVAL*3}; // ms
+// kcp 窗口探测命令字，与 ikcp.c 一致；保活探测只有一个 kcp 头
+const char KCP_CMD_WASK{83};
+const int KCP_PROBE_SIZE{24};
+
+// 控制包（握手/断开）：4 字节 conv 固定为 0 + 1 字节类型 + 负载，与服务端一致，整数按小端编码
+const int KCP_CTRL_HEAD_SIZE{5};
+const int KCP_COOKIE_SIZE{12};
+const int KCP_MIGRATE_TOKEN_SIZE{8};
+const int KCP_RESUME_SIZE{4 + KCP_MIGRATE_TOKEN_SIZE + 8};   // conv + 票据 + snd_una + rcv_nxt
+const int KCP_CTRL_MAX_SIZE{KCP_CTRL_HEAD_SIZE + KCP_RESUME_SIZE};
 
 namespace KCP {
     // 回调事件类型
@@ -27,11 +39,30 @@ namespace KCP {
         eDisconnect,            // 服务端关闭或异常
         eRecvMsg                // kcp收到消息后解析后raw msg回调
     };
+    // 控制包类型
+    enum eCtrlType {
+        eCtrlNone = 0,          // 不是控制包，按 kcp 包处理
+        eCtrlConnect,           // client -> server 请求连接
+        eCtrlChallenge,         // server -> client 返回 cookie
+        eCtrlCookieEcho,        // client -> server 原样带回 cookie
+        eCtrlAccept,            // server -> client 返回 conv + 迁移令牌
+        eCtrlDisconnect,        // server -> client 连接已关闭，负载为 conv
+        eCtrlMigrateRequest,    // server -> client 本端地址变了（NAT 重绑定），要求出示迁移令牌
+        eCtrlMigrate,           // client -> server conv + 迁移令牌，连接切换到新地址，kcp 状态保留
+        eCtrlResume,            // client -> server conv + 票据 + 本端 snd_una/rcv_nxt，断线后 0-RTT 恢复会话
+    };
     // 回调函数类型
     typedef void(client_event_callback_t)(uint32_t, eEventType, const std::string&, void*);
-    bool isRequireConnect(const char* buffer, int len);
-    std::string generateConnectMsg(uint32_t conv);
-    uint32_t getKcpConv(const char* buffer, int len);
+    // 返回控制包类型，kcp 数据包返回 eCtrlNone
+    eCtrlType getCtrlType(const char* buffer, int len);
+    // 在 buffer 中生成控制包，返回包长度；buffer 至少 KCP_CTRL_HEAD_SIZE + payload_len
+    int encodeCtrlPacket(char* buffer, eCtrlType type, const char* payload, int payload_len);
+    void encode32u(char* p, uint32_t value);
+    uint32_t decode32u(const char* p);
+    // 在 buffer 中生成一个不带数据的 kcp 窗口探测包，返回 KCP_PROBE_SIZE
+    int encodeKcpProbe(char* buffer, uint32_t conv, char cmd, uint32_t wnd, uint32_t ts, uint32_t una);
+    // 基于 CLOCK_MONOTONIC 的毫秒时间戳，kcp 计时统一使用，不受系统时间调整影响
+    uint32_t getCurClock();
 };
 
 #define KCP_CONNECTED 0
@@ -48,4 +79,6 @@ namespace KCP {
 #define KCP_ERR_RECV_CONV_FAILED -2007
 
 #define KCP_ERR_CREATE_KCPCB_FAILED -3000
-#define KCP_ERR_CONNECT_TIMEOUT -3001
\ No newline at end of file
+#define KCP_ERR_CONNECT_TIMEOUT -3001
+#define KCP_ERR_NO_SESSION -3002
+#define KCP_ERR_IN_CALLBACK -3003
\ No newline at end of file
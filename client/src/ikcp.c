@@ -453,15 +453,55 @@ int ikcp_peeksize(const ikcpcb *kcp)
 
 
 //---------------------------------------------------------------------
-// user/upper level send, returns below zero for error
+// send source: scatter-gather input of ikcp_send/ikcp_sendv
 //---------------------------------------------------------------------
-int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
+// source of ikcp_send_segments: the buffers of a send, consumed in order
+typedef struct
+{
+	const ikcpvec *vec;
+	int count;
+	int offset;		// bytes already taken from vec[0]
+}	ikcp_source;
+
+// take 'size' bytes from the source, copying them to dst when data exists
+static void ikcp_source_take(ikcp_source *src, char *dst, int size)
+{
+	while (size > 0 && src->count > 0) {
+		int avail = src->vec->len - src->offset;
+		int n = (size < avail)? size : avail;
+		if (src->vec->data) {
+			memcpy(dst, src->vec->data + src->offset, n);
+		}
+		dst += n;
+		src->offset += n;
+		size -= n;
+		if (src->offset == src->vec->len) {
+			src->vec++;
+			src->count--;
+			src->offset = 0;
+		}
+	}
+}
+
+static int ikcp_send_segments(ikcpcb *kcp, const ikcpvec *vec, int nvec)
 {
 	IKCPSEG *seg;
+	ikcp_source src;
 	int count, i;
+	long total = 0;
+	int len;
 
 	assert(kcp->mss > 0);
-	if (len < 0) return -1;
+	if (nvec < 0) return -1;
+	for (i = 0; i < nvec; i++) {
+		if (vec[i].len < 0) return -1;
+		total += vec[i].len;
+		if (total > 0x7fffffff) return -1;
+	}
+	len = (int)total;
+	src.vec = vec;
+	src.count = nvec;
+	src.offset = 0;
 
 	if (len <= (int)kcp->mss) count = 1;
 	else count = (len + kcp->mss - 1) / kcp->mss;
@@ -478,23 +518,34 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 		if (seg == NULL) {
 			return -2;
 		}
-		if (buffer && len > 0) {
-			memcpy(seg->data, buffer, size);
-		}
+		ikcp_source_take(&src, seg->data, size);
 		seg->len = size;
 		seg->frg = count - i - 1;
 		iqueue_init(&seg->node);
 		iqueue_add_tail(&seg->node, &kcp->snd_queue);
 		kcp->nsnd_que++;
-		if (buffer) {
-			buffer += size;
-		}
 		len -= size;
 	}
 
 	return 0;
 }
 
+//---------------------------------------------------------------------
+// user/upper level send, returns below zero for error
+//---------------------------------------------------------------------
+int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
+{
+	ikcpvec vec;
+	vec.data = buffer;
+	vec.len = len;
+	return ikcp_send_segments(kcp, &vec, 1);
+}
+
+int ikcp_sendv(ikcpcb *kcp, const ikcpvec *vec, int count)
+{
+	return ikcp_send_segments(kcp, vec, count);
+}
+
 
 //---------------------------------------------------------------------
 // parse ack
@@ -5,6 +5,8 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include <iostream>
 #include <cstring>
@@ -16,6 +18,10 @@
 #include <exception>
 #include <mutex>
 #include <atomic>
+#include <condition_variable>
+#include <algorithm>
+#include <climits>
+#include <vector>
 
 #include "ikcp.h"
 
@@ -31,7 +37,9 @@ public:
     // 设置上层回调，进行事件通知
     void set_event_callback(const client_event_callback_t& event_callback_func, void* var);
     int connect();
+    int resume();
     void send(const std::string& msg);
+    int sendv(const struct iovec* iov, int iovcnt);
     void exit();
 
 private:   
@@ -40,12 +48,21 @@ private:
     void transferKcp(std::promise<int>& prom);
     void start();
     void stop();
+    // 停止并回收收发线程，kcp 保留
+    void joinThreads();
+    // 当前是否在收发线程中（即事件回调里），这时不能回收线程
+    bool inWorkerThread() const;
+    void spawnThreads();
     // 发送客户端数据
     void updateInLoop();
     // 接收数据
     void recvInLoop();
+    // 空闲时发保活探测，长时间收不到服务端的包时通知上层，update 线程持 kcp_mtx_ 调用，返回距离下一次探测的毫秒数
+    uint32_t keepalive(std::unique_lock<std::mutex>& lock, uint32_t current);
     // 处理从服务端接收到的消息，剔除kcp头部，解析出来的消息通过事件回调给上层
     void processMsg(const std::string& msg);
+    // 处理服务端发来的控制包（断开、迁移请求）
+    void processCtrlMsg(eCtrlType type, const std::string& msg);
     
     // 初始化套接字
     int initUdpConnect();
@@ -64,6 +81,13 @@ private:
 
     ikcpcb* kcp_{};
     std::mutex kcp_mtx_;
+    char migrate_token_[KCP_MIGRATE_TOKEN_SIZE]{};  // accept 时服务端下发
+    // update 线程按 kcp 下次需要 update 的时间睡眠，没有待发送数据时一直挂起，send/收包时唤醒
+    std::condition_variable update_cv_;
+    uint32_t last_output_clock_{0};                 // 最近一次发出包的时间，持 kcp_mtx_ 访问
+    std::atomic<uint32_t> last_recv_clock_{0};      // 最近一次收到服务端包的时间
+    uint32_t lost_recv_clock_{0};                   // 已经按这个收包时间报告过超时，只在 update 线程访问
+    int wakeup_fd_{-1};     // eventfd，exit 时唤醒阻塞在 poll 中的 recv 线程
     
     std::atomic_bool running_{false};
     std::thread thread_[2];
@@ -89,6 +113,10 @@ int KcpClient::connect() {
     return session_->connect();
 }
 
+int KcpClient::resume() {
+    return session_->resume();
+}
+
 void KcpClient::exit() {
     session_->exit();
 }
@@ -97,16 +125,27 @@ void KcpClient::send(const std::string& msg) {
     session_->send(msg);
 }
 
+int KcpClient::sendv(const struct iovec* iov, int iovcnt) {
+    return session_->sendv(iov, iovcnt);
+}
+
 /////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////
 
 SESSION::Session(const std::string& ip, const int port) : server_ip_(ip), server_port_(port) {
     initUdpConnect();
+    wakeup_fd_ = ::eventfd(0, EFD_NONBLOCK);
+    if (wakeup_fd_ < 0) {
+        std::cerr << "eventfd error return with errno: " << errno << " " << strerror(errno) << std::endl;
+    }
 }
 
 SESSION::~Session() {
-    if (running_)
-        exit();
+    exit();
+    if (wakeup_fd_ >= 0) {
+        ::close(wakeup_fd_);
+        wakeup_fd_ = -1;
+    }
 }
 
 void SESSION::set_event_callback(const client_event_callback_t& event_callback_func, void* val) {
@@ -116,6 +155,21 @@ void SESSION::set_event_callback(const client_event_callback_t& event_callback_f
 
 int SESSION::connect() {
     if (running_) { return SUCCESS; };
+    if (inWorkerThread()) { return KCP_ERR_IN_CALLBACK; }
+
+    // 上一个会话被服务端断开时收发线程已自行退出，这里回收线程和旧 kcp，exit 后重建套接字
+    joinThreads();
+    {
+        std::lock_guard<std::mutex> lock(kcp_mtx_);
+        if (kcp_) {
+            ::ikcp_release(kcp_);
+            kcp_ = nullptr;
+        }
+    }
+    if (sock_fd_ < 0) {
+        int ret = initUdpConnect();
+        if (ret != SUCCESS) { return ret; }
+    }
     
     std::promise<int> prom;
     std::future<int> fut = prom.get_future();
@@ -139,14 +193,62 @@ int SESSION::connect() {
     }
     
     start();
+    spawnThreads();
 
-    std::function<void()> update_task([this] {this->updateInLoop();});
-    thread_[0] = std::thread(std::move(update_task));
+    std::cout << "connect success!" << std::endl;
+    return SUCCESS;
+}
 
-    std::function<void()> run_task([this] {this->recvInLoop();});
-    thread_[1] = std::thread(std::move(run_task));
+int SESSION::resume() {
+    if (inWorkerThread())
+        return KCP_ERR_IN_CALLBACK;
+    {
+        std::lock_guard<std::mutex> lock(kcp_mtx_);
+        // 已被服务端断开的会话不能恢复，只能重新 connect
+        if (!kcp_ || !running_)
+            return KCP_ERR_NO_SESSION;
+    }
+    joinThreads();
 
-    std::cout << "connect success!" << std::endl;
+    // 换一个新套接字（新的本地端口），旧的可能已经绑在失效的网络上
+    if (sock_fd_ >= 0)
+        ::close(sock_fd_);
+    int ret = initUdpConnect();
+    if (ret != SUCCESS)
+        return ret;
+
+    uint32_t conv = 0;
+    {
+        std::lock_guard<std::mutex> lock(kcp_mtx_);
+        conv = kcp_->conv;
+        // 票据即 accept 下发的迁移令牌；带上本端序号，服务端已回收会话时按此重建 kcp
+        char payload[KCP_RESUME_SIZE];
+        encode32u(payload, conv);
+        ::memcpy(payload + 4, migrate_token_, KCP_MIGRATE_TOKEN_SIZE);
+        encode32u(payload + 4 + KCP_MIGRATE_TOKEN_SIZE, kcp_->snd_una);
+        encode32u(payload + 8 + KCP_MIGRATE_TOKEN_SIZE, kcp_->rcv_nxt);
+        char resume_msg[KCP_CTRL_MAX_SIZE];
+        int len = encodeCtrlPacket(resume_msg, eCtrlResume, payload, sizeof(payload));
+        if (::send(sock_fd_, resume_msg, len, 0) < 0) {
+            std::cerr << "send resume failed with errno: " << errno << " " << strerror(errno) << std::endl;
+            return KCP_ERR_SEND_FAILED;
+        }
+
+        // 0-RTT：未确认的数据紧跟恢复包立即重传，不等服务端回应
+        uint32_t current = getCurClock();
+        struct IQUEUEHEAD *p;
+        for (p = kcp_->snd_buf.next; p != &kcp_->snd_buf; p = p->next) {
+            IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+            seg->resendts = current;
+        }
+        kcp_->current = current;
+        ikcp_flush(kcp_);
+    }
+
+    start();
+    spawnThreads();
+
+    std::cout << "resume conv: " << conv << std::endl;
     return SUCCESS;
 }
 
@@ -159,15 +261,42 @@ void SESSION::send(const std::string& msg) {
             std::cerr << "ikcp_send error return with errno: " << ret << std::endl; 
         }
     }
+    update_cv_.notify_one();
+}
+
+int SESSION::sendv(const struct iovec* iov, int iovcnt) {
+    if (iovcnt < 0) return -1;
+    ikcpvec inline_vec[KCP_SENDV_INLINE];
+    std::vector<ikcpvec> heap_vec;
+    ikcpvec* vec = inline_vec;
+    if (iovcnt > KCP_SENDV_INLINE) {
+        heap_vec.resize(iovcnt);
+        vec = heap_vec.data();
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > (size_t)INT_MAX) return -1;
+        vec[i].data = static_cast<const char*>(iov[i].iov_base);
+        vec[i].len = static_cast<int>(iov[i].iov_len);
+    }
+    int ret;
+    {
+        std::lock_guard<std::mutex> lock(kcp_mtx_);
+        ret = ikcp_sendv(kcp_, vec, iovcnt);
+        if (ret < 0) {
+            std::cerr << "ikcp_sendv error return with errno: " << ret << std::endl; 
+        }
+    }
+    update_cv_.notify_one();
+    return ret;
 }
 
 void SESSION::exit() {
-    if (!running_) return;
-    stop();
-    // wait for thread exit normally.
-    for (int i = 0; i < 2; ++i)
-        if(thread_[i].joinable()) 
-            thread_[i].join();
+    if (inWorkerThread()) {
+        std::cerr << "exit called from event callback, ignored." << std::endl;
+        return;
+    }
+    // 被服务端断开后 running_ 已为 false，线程、kcp 和套接字仍需回收
+    joinThreads();
 
     {
         std::lock_guard<std::mutex> lock(kcp_mtx_);
@@ -177,45 +306,94 @@ void SESSION::exit() {
         }        
     }
 
-    if (sock_fd_) {
+    if (sock_fd_ >= 0) {
         ::close(sock_fd_);
-        sock_fd_ = 0;
+        sock_fd_ = -1;
     }
 }
 
 void SESSION::updateInLoop() {
     std::cout << "thread_update start: " << std::this_thread::get_id() << std::endl;
 
-    auto last = std::chrono::system_clock::now();
-
+    std::unique_lock<std::mutex> lock(kcp_mtx_);
     while (running_) {
-        auto current = std::chrono::system_clock::now();
-        if (std::chrono::duration_cast<std::chrono::milliseconds>(current-last).count() >= KCP_UPDATE_INTERVAL || (current < last)) {
-            {
-                std::lock_guard<std::mutex> lock(kcp_mtx_);
-                if (!kcp_) return;
-                ikcp_update(kcp_, current.time_since_epoch().count());
-            }
-            last = current;
+        if (!kcp_) return;
+        uint32_t current = getCurClock();
+        ikcp_update(kcp_, current);
+        // 没有待发送/待确认的数据，没有待回的 ack，也不需要窗口探测，挂起直到 send、收包或需要保活
+        if (ikcp_waitsnd(kcp_) == 0 && kcp_->ackcount == 0 && kcp_->probe == 0 && kcp_->rmt_wnd != 0) {
+            uint32_t wait_ms = keepalive(lock, current);
+            if (!running_ || !kcp_) break;
+            update_cv_.wait_for(lock, std::chrono::milliseconds(wait_ms));
+        } else {
+            update_cv_.wait_for(lock, std::chrono::milliseconds(ikcp_check(kcp_, current) - current));
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1)); // sleep 1ms
     }
     std::cout << "thread_update exit." << std::endl;
 }
 
+uint32_t SESSION::keepalive(std::unique_lock<std::mutex>& lock, uint32_t current) {
+    const uint32_t last_recv_clock = last_recv_clock_.load();
+    if ((int32_t)(current - last_recv_clock) >= (int32_t)KCP_KEEPALIVE_TIMEOUT && lost_recv_clock_ != last_recv_clock) {
+        lost_recv_clock_ = last_recv_clock;
+        const uint32_t conv = kcp_->conv;
+        std::cout << "keepalive timeout." << std::endl;
+        // 回调中上层可能调用 send，锁外通知；resume 需在应用线程调用
+        lock.unlock();
+        if (pevent_func_)
+            pevent_func_(conv, eDisconnect, "keepalive timeout", pevent_func_val_);
+        lock.lock();
+        if (!running_ || !kcp_)
+            return 0;
+    }
+    // 数据和 ack 已经证明本端存活，只有一段时间什么都没发出时才探测
+    int32_t idle_ms = (int32_t)(current - last_output_clock_);
+    if (idle_ms >= (int32_t)KCP_KEEPALIVE_INTERVAL) {
+        char probe[KCP_PROBE_SIZE];
+        int len = encodeKcpProbe(probe, kcp_->conv, KCP_CMD_WASK, kcp_->rcv_wnd, current, kcp_->rcv_nxt);
+        if (::send(sock_fd_, probe, len, 0) < 0) {
+            std::cerr << "send keepalive failed with errno: " << errno << " " << strerror(errno) << std::endl;
+        }
+        last_output_clock_ = current;
+        idle_ms = 0;
+    }
+    return KCP_KEEPALIVE_INTERVAL - idle_ms;
+}
+
 void SESSION::recvInLoop() {
     std::cout << "thread_recvInLoop start: " << std::this_thread::get_id() << std::endl;
 
     setNonblock();
     
     char buffer[MAX_MSG_SIZE]{};
+    struct pollfd fds[2]{};
+    fds[0].fd = sock_fd_;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakeup_fd_;
+    fds[1].events = POLLIN;
     while (running_){
         try {
-            const ssize_t len = ::recv(sock_fd_, buffer, sizeof(buffer), 0);
-            if (len > 0) {
+            // 阻塞等待数据或 exit 唤醒，不再空转
+            int nfds = ::poll(fds, 2, -1);
+            if (nfds < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error("poll failed");
+            }
+            if (fds[1].revents & POLLIN) break;
+            // 非阻塞读完所有数据
+            while (true) {
+                const ssize_t len = ::recv(sock_fd_, buffer, sizeof(buffer), 0);
+                if (len <= 0) break;
+                last_recv_clock_ = getCurClock();
                 processMsg(std::string(buffer, len));
             }
-        } catch (std::exception e) {
+            // 这批数据处理完立即回 ack（顺带发出已可发送的数据），不等下一次 update
+            {
+                std::lock_guard<std::mutex> lock(kcp_mtx_);
+                if (kcp_ && kcp_->ackcount > 0)
+                    ikcp_flush(kcp_);
+            }
+        } catch (std::exception& e) {
             std::ostringstream ossm;
             ossm << "recv error with errno: " << errno << " " << strerror(errno);
             std::cout << ossm.str() << std::endl;
@@ -229,8 +407,10 @@ void SESSION::recvInLoop() {
 }
 
 void SESSION::requireKcpConv() {
-    std::cout << "send packet: " << KCP_CONNECT_PACKET << std::endl;
-    const ssize_t ret = ::send(sock_fd_, KCP_CONNECT_PACKET.c_str(), KCP_CONNECT_PACKET.length(), 0);
+    std::cout << "send connect packet" << std::endl;
+    char connect_msg[KCP_CTRL_MAX_SIZE];
+    int len = encodeCtrlPacket(connect_msg, eCtrlConnect, nullptr, 0);
+    const ssize_t ret = ::send(sock_fd_, connect_msg, len, 0);
     if (ret < 0) {
         std::cerr << "send require kcp conv failed with errno: " << errno << " " << strerror(errno) << std::endl;
     }
@@ -240,19 +420,57 @@ void SESSION::transferKcp(std::promise<int>& prom) {
     std::cout << "wait for kcp conv back..." << std::endl;
     char buffer[1400]{};
 
-    const ssize_t len = ::recv(sock_fd_, buffer, sizeof(buffer), 0);
-    if (len < 0 && len != EAGAIN) {
-        std::cerr << "recv error with errno: " << errno << " " << strerror(errno) << std::endl;
-        prom.set_value(KCP_ERR_RECV_CONV_FAILED);
-        return;
-    }
-    
-    std::cout << "recv conv packet: " << buffer << " len: " << len << std::endl;
-    auto conv = getKcpConv(buffer, len);
-    if (conv == NOT_KCP_CONNECT_PACK) {
-        std::cerr << "recv conv error while parse failed." << std::endl;
-        prom.set_value(KCP_ERR_RECV_CONV_FAILED);
-        return;
+    // connect -> challenge(cookie) -> cookie echo -> accept(conv)
+    struct pollfd pfd{};
+    pfd.fd = sock_fd_;
+    pfd.events = POLLIN;
+    const uint32_t deadline = getCurClock() + KCP_CONNECT_TIMEOUT;
+    uint32_t conv = 0;
+    while (conv == 0) {
+        const int wait_ms = (int32_t)(deadline - getCurClock());
+        const int nfds = wait_ms > 0 ? ::poll(&pfd, 1, wait_ms) : 0;
+        if (nfds == 0) {
+            std::cerr << "wait for kcp conv timeout." << std::endl;
+            prom.set_value(KCP_ERR_CONNECT_TIMEOUT);
+            return;
+        }
+        if (nfds < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "poll error with errno: " << errno << " " << strerror(errno) << std::endl;
+            prom.set_value(KCP_ERR_RECV_CONV_FAILED);
+            return;
+        }
+
+        const ssize_t len = ::recv(sock_fd_, buffer, sizeof(buffer), 0);
+        if (len < 0) {
+            std::cerr << "recv error with errno: " << errno << " " << strerror(errno) << std::endl;
+            prom.set_value(KCP_ERR_RECV_CONV_FAILED);
+            return;
+        }
+
+        switch (getCtrlType(buffer, len)) {
+            case eCtrlChallenge: {
+                // cookie 原样带回，服务端验证通过后才分配连接
+                char echo_msg[KCP_CTRL_MAX_SIZE];
+                int cookie_len = std::min((int)len - KCP_CTRL_HEAD_SIZE, KCP_COOKIE_SIZE);
+                int echo_len = encodeCtrlPacket(echo_msg, eCtrlCookieEcho, buffer + KCP_CTRL_HEAD_SIZE, cookie_len);
+                if (::send(sock_fd_, echo_msg, echo_len, 0) < 0) {
+                    std::cerr << "send cookie echo failed with errno: " << errno << " " << strerror(errno) << std::endl;
+                    prom.set_value(KCP_ERR_SEND_FAILED);
+                    return;
+                }
+                break;
+            }
+            case eCtrlAccept:
+                if (len >= KCP_CTRL_HEAD_SIZE + 4 + KCP_MIGRATE_TOKEN_SIZE) {
+                    conv = decode32u(buffer + KCP_CTRL_HEAD_SIZE);
+                    ::memcpy(migrate_token_, buffer + KCP_CTRL_HEAD_SIZE + 4, KCP_MIGRATE_TOKEN_SIZE);
+                }
+                break;
+            default:
+                // 忽略其它包，例如上一个连接残留的 kcp 包
+                break;
+        }
     }
 
     std::cout << "get conv: " << conv << std::endl;
@@ -268,18 +486,64 @@ void SESSION::transferKcp(std::promise<int>& prom) {
 }
 
 void SESSION::start() {
+    last_recv_clock_ = getCurClock();
+    last_output_clock_ = last_recv_clock_;
     running_ = true;
 }
 
 void SESSION::stop() {
-    running_ = false;
+    {
+        // 持锁修改，避免 update 线程在检查 running_ 之后、挂起之前错过唤醒
+        std::lock_guard<std::mutex> lock(kcp_mtx_);
+        running_ = false;
+    }
+    update_cv_.notify_all();
+    if (wakeup_fd_ >= 0) {
+        uint64_t one = 1;
+        ::write(wakeup_fd_, &one, sizeof(one));
+    }
+}
+
+void SESSION::joinThreads() {
+    stop();
+    // wait for thread exit normally.
+    for (int i = 0; i < 2; ++i)
+        if(thread_[i].joinable()) 
+            thread_[i].join();
+    // 清空 eventfd 计数，便于再次 connect/resume
+    if (wakeup_fd_ >= 0) {
+        uint64_t count = 0;
+        ::read(wakeup_fd_, &count, sizeof(count));
+    }
+}
+
+bool SESSION::inWorkerThread() const {
+    const std::thread::id self = std::this_thread::get_id();
+    return thread_[0].get_id() == self || thread_[1].get_id() == self;
+}
+
+void SESSION::spawnThreads() {
+    std::function<void()> update_task([this] {this->updateInLoop();});
+    thread_[0] = std::thread(std::move(update_task));
+
+    std::function<void()> run_task([this] {this->recvInLoop();});
+    thread_[1] = std::thread(std::move(run_task));
 }
 
 void SESSION::processMsg(const std::string& recv_buffer) {
+    eCtrlType ctrl_type = getCtrlType(recv_buffer.c_str(), recv_buffer.length());
+    if (ctrl_type != eCtrlNone) {
+        processCtrlMsg(ctrl_type, recv_buffer);
+        return;
+    }
     {    
         std::lock_guard<std::mutex> lock(kcp_mtx_);
+        // update 线程挂起时 kcp 内部时间可能已过期，先同步，保证 rtt 计算正确
+        kcp_->current = getCurClock();
         ikcp_input(kcp_, recv_buffer.c_str(), recv_buffer.length());
     }
+    // 唤醒 update 线程回 ack
+    update_cv_.notify_one();
     while (true) {
         char buffer[MAX_MSG_SIZE]{};
         int len = 0;
@@ -298,6 +562,34 @@ void SESSION::processMsg(const std::string& recv_buffer) {
     }
 }
 
+void SESSION::processCtrlMsg(eCtrlType type, const std::string& recv_buffer) {
+    if (recv_buffer.length() < (size_t)KCP_CTRL_HEAD_SIZE + 4 || decode32u(recv_buffer.c_str() + KCP_CTRL_HEAD_SIZE) != kcp_->conv)
+        return;
+    switch (type) {
+        case eCtrlDisconnect:
+            std::cout << "disconnected by server." << std::endl;
+            // 会话已失效（包括恢复被拒绝），收发线程自行退出，由上层重新 connect 时回收
+            stop();
+            if (pevent_func_)
+                pevent_func_(kcp_->conv, eDisconnect, "disconnected by server", pevent_func_val_);
+            break;
+        case eCtrlMigrateRequest: {
+            // 本端出口地址变了，出示令牌让服务端把连接切换过来，kcp 状态和在途数据都保留
+            char payload[4 + KCP_MIGRATE_TOKEN_SIZE];
+            encode32u(payload, kcp_->conv);
+            ::memcpy(payload + 4, migrate_token_, KCP_MIGRATE_TOKEN_SIZE);
+            char migrate_msg[KCP_CTRL_MAX_SIZE];
+            int len = encodeCtrlPacket(migrate_msg, eCtrlMigrate, payload, sizeof(payload));
+            if (::send(sock_fd_, migrate_msg, len, 0) < 0) {
+                std::cerr << "send migrate failed with errno: " << errno << " " << strerror(errno) << std::endl;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
 int SESSION::initUdpConnect() {
     // 创建套接字
     {
@@ -314,6 +606,8 @@ int SESSION::initUdpConnect() {
         server_addr.sin_port = htons(server_port_);
         if (::inet_pton(AF_INET, server_ip_.c_str(), &server_addr.sin_addr) <= 0) {
             std::cerr << "inet_pton error return <= 0, with errno: " << errno << " " << strerror(errno) << std::endl;
+            ::close(sock_fd_);
+            sock_fd_ = -1;
             return KCP_ERR_ADDRESS_INVALID;
         }
         // ::bind(sock_fd_, (struct sockaddr*)&server_addr, sizeof(server_addr));
@@ -323,6 +617,8 @@ int SESSION::initUdpConnect() {
         int ret = ::connect(sock_fd_, (struct sockaddr*)&server_addr, sizeof(server_addr));
         if (ret < 0) {
             std::cerr << "connect error return with errno: " << errno << " " << strerror(errno) << std::endl;
+            ::close(sock_fd_);
+            sock_fd_ = -1;
             return KCP_ERR_CONNECT_FAILED;
         }
     }
@@ -354,6 +650,7 @@ int SESSION::initKcp(unsigned int conv) {
 }
 
 int SESSION::kcpOutput(const char *buf, int len, ikcpcb* kcp, void *user) {
+    ((SESSION*)user)->last_output_clock_ = kcp->current;
     ssize_t ret = ::send(((SESSION*)user)->sock_fd_, buf, len, 0);
     if (ret < 0) {
         std::cerr << "send error with errno: " << errno << " " << strerror(errno) << std::endl;
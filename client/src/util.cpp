@@ -1,15 +1,56 @@
 #include "util.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 namespace KCP {
 
-    uint32_t getKcpConv(const char* buffer, int len) {
-        int head_len = KCP_SEND_CONV_PACKET.length();
-        if ((len > head_len) && (0 == KCP_SEND_CONV_PACKET.compare(std::string(buffer, head_len)))) {
-            return atol(buffer+head_len);
-        }
-        return NOT_KCP_CONNECT_PACK;
+    eCtrlType getCtrlType(const char* buffer, int len) {
+        if (len < KCP_CTRL_HEAD_SIZE || decode32u(buffer) != 0)
+            return eCtrlNone;
+        unsigned char type = (unsigned char)buffer[4];
+        if (type <= eCtrlNone || type > eCtrlResume)
+            return eCtrlNone;
+        return (eCtrlType)type;
+    }
+
+    int encodeCtrlPacket(char* buffer, eCtrlType type, const char* payload, int payload_len) {
+        encode32u(buffer, 0);
+        buffer[4] = (char)type;
+        if (payload_len > 0)
+            ::memcpy(buffer + KCP_CTRL_HEAD_SIZE, payload, payload_len);
+        return KCP_CTRL_HEAD_SIZE + payload_len;
+    }
+
+    void encode32u(char* p, uint32_t value) {
+        p[0] = (char)(value & 0xff);
+        p[1] = (char)((value >> 8) & 0xff);
+        p[2] = (char)((value >> 16) & 0xff);
+        p[3] = (char)((value >> 24) & 0xff);
+    }
+
+    uint32_t decode32u(const char* p) {
+        const unsigned char* u = (const unsigned char*)p;
+        return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+    }
+
+    int encodeKcpProbe(char* buffer, uint32_t conv, char cmd, uint32_t wnd, uint32_t ts, uint32_t una) {
+        // conv | cmd | frg | wnd(16) | ts | sn | una | len
+        ::memset(buffer, 0, KCP_PROBE_SIZE);
+        encode32u(buffer, conv);
+        buffer[4] = cmd;
+        buffer[6] = (char)(wnd & 0xff);
+        buffer[7] = (char)((wnd >> 8) & 0xff);
+        encode32u(buffer + 8, ts);
+        encode32u(buffer + 16, una);
+        return KCP_PROBE_SIZE;
+    }
+
+    uint32_t getCurClock() {
+        struct timespec ts{};
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
     }
 
 };
\ No newline at end of file
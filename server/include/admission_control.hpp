@@ -0,0 +1,82 @@
+#pragma once
+
+#include "util.hpp"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+namespace KCP {
+
+// 握手准入限速参数，速率为每秒个数，burst 为令牌桶容量
+struct handshake_limits {
+    uint32_t challenge_rate{KCP_CHALLENGE_RATE};    // 全局回复 cookie 的速率，限制反射放大
+    uint32_t challenge_burst{KCP_CHALLENGE_BURST};
+    uint32_t accept_rate{KCP_HANDSHAKE_RATE};       // 全局新建连接速率
+    uint32_t accept_burst{KCP_HANDSHAKE_BURST};
+    uint32_t ip_rate{KCP_HANDSHAKE_IP_RATE};        // 单个源 IP 新建连接速率
+    uint32_t ip_burst{KCP_HANDSHAKE_IP_BURST};
+};
+
+// 握手准入统计，只增不减
+struct handshake_stats {
+    uint64_t challenges_sent{0};
+    uint64_t challenges_dropped{0};     // 超过全局 cookie 速率
+    uint64_t cookies_invalid{0};
+    uint64_t accepted{0};
+    uint64_t deduplicated{0};           // 同一地址已有连接，重发 accept 而不新建
+    uint64_t global_rate_limited{0};    // 超过全局新建连接速率
+    uint64_t ip_rate_limited{0};        // 超过单 IP 新建连接速率或 IP 表已满
+};
+
+// 握手准入控制：全局 cookie 速率、全局新建连接速率、按源 IP 的令牌桶
+// 单 IP 令牌桶只对 cookie 验证通过（源地址真实）的请求生效，伪造源地址无法撑满 IP 表
+class admission_control {
+public:
+    enum eAdmission {
+        eAdmitted,
+        eGlobalLimited,
+        eIpLimited,
+    };
+
+    admission_control() = default;
+
+    void setLimits(const handshake_limits& limits);
+    // 收到 connect 时调用，返回是否回复 cookie
+    bool allowChallenge(uint32_t clock);
+    // cookie 验证通过、准备新建连接时调用
+    eAdmission allowAccept(const struct sockaddr_in& addr, uint32_t clock);
+
+    // 以下只更新统计
+    void onCookieInvalid() { ++cookies_invalid_; }
+    void onDeduplicated() { ++deduplicated_; }
+
+    handshake_stats getStats() const;
+
+private:
+    struct token_bucket {
+        double tokens{0};
+        uint32_t last_clock{0};
+        bool inited{false};
+    };
+    // 按 rate（每秒）补充令牌后取一个，没有令牌返回 false
+    static bool take(token_bucket& bucket, uint32_t clock, uint32_t rate, uint32_t burst);
+    // IP 表满时清理已经回满（长时间没有握手）的令牌桶
+    void sweepIdleLocked(uint32_t clock);
+
+private:
+    std::mutex mutex_;
+    handshake_limits limits_;
+    token_bucket challenge_bucket_;
+    token_bucket accept_bucket_;
+    std::unordered_map<uint32_t, token_bucket> ip_buckets_;    // key 为网络字节序 IPv4 地址
+
+    std::atomic<uint64_t> challenges_sent_{0};
+    std::atomic<uint64_t> challenges_dropped_{0};
+    std::atomic<uint64_t> cookies_invalid_{0};
+    std::atomic<uint64_t> accepted_{0};
+    std::atomic<uint64_t> deduplicated_{0};
+    std::atomic<uint64_t> global_rate_limited_{0};
+    std::atomic<uint64_t> ip_rate_limited_{0};
+};
+
+};
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <atomic>
+
+typedef unsigned int uint32_t;
+
+namespace KCP {
+
+// 单调毫秒时钟：基于 CLOCK_MONOTONIC，不受 NTP/手动修改系统时间影响
+// recv 线程每批消息、update 线程每轮循环调用 tick() 刷新缓存，在这两个线程里 now() 足够新；
+// update 线程挂起时缓存可能停在几秒之前，应用线程进来的路径（send、forceDisconnect 等）要先 tick()
+class clock_service {
+public:
+    // 读取 CLOCK_MONOTONIC 刷新缓存的毫秒时间戳并返回
+    static uint32_t tick();
+    // 读取缓存的毫秒时间戳，只是一次 relaxed atomic load
+    static uint32_t now() { return s_cur_ms_.load(std::memory_order_relaxed); }
+
+private:
+    static std::atomic<uint32_t> s_cur_ms_;
+};
+
+};
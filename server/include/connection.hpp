@@ -1,43 +1,119 @@
 #pragma once
 
 #include "util.hpp"
+#include "slab_pool.hpp"
+#include "segment_pool.hpp"
+#include <sys/uio.h>
 #include <chrono>
 #include <mutex>
+#include <list>
+#include <atomic>
 
 namespace KCP {
 
 class connection_manager;
 
 class connection {
+    friend class connection_container;
 public:
     connection(const std::weak_ptr<connection_manager>&);
     ~connection();
 
-    static std::shared_ptr<connection> create(const std::weak_ptr<connection_manager>&, const uint32_t conv, const struct sockaddr_in* addr);
+    static std::shared_ptr<connection> create(const std::weak_ptr<connection_manager>&, const uint32_t conv, const struct sockaddr_in* addr, const slab_allocator<connection>& alloc, const std::shared_ptr<segment_pool>& segments);
 
-    void input(const std::string& msg);
+    uint32_t getConv() const { return conv_; }
+    // 会话恢复时按客户端的状态对齐 kcp 序号，只在加入 container 前调用
+    void resumeSequence(uint32_t snd_nxt, uint32_t rcv_nxt);
+    // 客户端地址（addrKey），NAT 重绑定迁移时由 recv 线程修改，update 线程发送时读取
+    uint64_t getAddrKey() const { return addr_key_.load(); }
+    // 会话随机数，建立连接时由 container 生成，迁移令牌由它派生；会话恢复和热重启时沿用
+    uint64_t getSessionNonce() const { return session_nonce_; }
+
+    // 返回 true 表示有待回的 ack，需要在本批收包处理完后 flush
+    bool input(const std::string& msg);
+    // 处理客户端保活探测（WASK），休眠中直接用保存的状态回 WINS 不重建 kcp，不计入活跃时间；
+    // 返回 true 表示 WINS 已交给 kcp，和 ack 一起在本批收包处理完后 flush
+    bool keepalive(const std::string& msg);
     void send(const std::string& msg);
-    void update(uint32_t clock);
+    // 零拷贝发送：不短于 KCP_ZERO_COPY_MIN 的消息由分片引用，持有 msg 直到最后一个分片被确认或释放
+    void send(const std::shared_ptr<std::string>& msg);
+    // 分散发送：iov 的各段按顺序作为一条消息直接分片进 kcp，返回 ikcp_sendv 的结果
+    int sendv(const struct iovec* iov, int iovcnt);
+    // 立即把发送队列中的数据和待回的 ack 发出去，不等下一次 update
+    void flush();
+    // 低延迟发送：标记本轮事件循环结束时需要 flush，返回 true 表示首次标记
+    bool markFlush() { return !flush_pending_.exchange(true); }
+    // 返回距离下一次需要 update 的毫秒数，-1 表示没有待发送/待确认的数据，不需要定时驱动
+    // hibernate_after 不为 0 时，空闲到期的连接在这里休眠，到期前返回剩余时间
+    int update(uint32_t clock, uint32_t hibernate_after);
+    bool hibernated() const { return kcp_ == nullptr; }
+    // 待发送和待确认的分片数
+    int waitSend();
+    // 热重启：序列化 kcp 完整状态（休眠中的连接先重建），新进程用 restoreKcp 恢复
+    void snapshotKcp(std::string& out);
+    bool restoreKcp(const std::string& data);
+    // 析构时不再单独通知客户端断开：已批量发出断开通知，或热重启后由新进程继续服务
+    void detach() { detached_ = true; }
+
+    // 通知上层连接断开，reason 为 timeout（空闲超时）或 dead link（对端失联）
+    void doTimeout(const std::string& reason);
+    // update 中检测到死链后置位，由 container 回收
+    bool isDead() const { return dead_; }
 
-    bool isTimeout() const;
-    void doTimeout();
+    // 固定这个连接的 update 间隔（ms），0 恢复默认的 KCP_UPDATE_INTERVAL；kcp 内部最低 10ms
+    void setUpdateInterval(int interval_ms);
 
 private:
     void initKcp(const uint32_t& conv);
     void clear();
+    // 休眠：只保留序号、窗口和 rtt 估计，释放 ikcpcb（含 ack 列表、队列和收发索引）；收包或 send 时透明重建
+    // 以下持 mutex_ 调用
+    bool canHibernate() const;
+    void hibernate();
+    void wakeKcp();
 
+    // send 前唤醒休眠的 kcp 并记录活跃时间，持 mutex_ 调用
+    void prepareSend();
     static int kcpOutput(const char* buf, int len, ikcpcb* kcp, void* user);
+    // ikcp_send_ref 的释放回调，opaque 是 send 时 new 出来的 shared_ptr
+    static void releasePayload(void* opaque);
+    // 取出一条完整消息交给上层，没有完整消息返回 false
+    bool deliver(connection_manager* manager, bool view);
     void sendUdpMsg(const char* buf, int len);
     
     uint32_t getCurClock() const;
 
 private:
     std::weak_ptr<connection_manager> connection_manager_;  // 通过上层的弱引用使用socket功能
-    struct sockaddr_in addr_{};
+    std::atomic<uint64_t> addr_key_{0};
+    uint64_t session_nonce_{0};         // 加入 container 前设置，之后只读
     ikcpcb* kcp_{nullptr};
+    std::shared_ptr<segment_pool> segments_;    // kcp_ 的内存池，保证在 kcp_ 释放之后才析构
     std::mutex mutex_;
     uint32_t conv_{0};                 // kcp的conv头部
-    uint32_t last_recv_msg_clock_{0};   // 用于计算客户端是否已经超时关闭
+    std::atomic<bool> flush_pending_{false};    // 已加入 manager 的待 flush 列表
+    int interval_override_{0};                  // 用户指定的 update 间隔，0 为默认，持 mutex_ 访问
+    uint32_t last_active_clock_{0};             // 最近一次收发数据的时间，持 mutex_ 访问
+    // 最近一次收到对端的包，或者没有在途数据时开始发送的时间；有在途数据时超过 KCP_DEAD_PEER_TIMEOUT 视为死链，持 mutex_ 访问
+    uint32_t peer_alive_clock_{0};
+    bool dead_{false};                          // 只在 update 线程访问
+    bool detached_{false};                      // 析构时不发断开通知
+    // 休眠时保存的 kcp 状态，持 mutex_ 访问
+    struct hibernate_state {
+        uint32_t snd_una;
+        uint32_t snd_nxt;
+        uint32_t rcv_nxt;
+        uint32_t rmt_wnd;
+        int32_t rx_srtt;
+        int32_t rx_rttval;
+        int32_t rx_rto;
+    } hibernate_state_{};
+    // update 定时记录，由 connection_container 在持锁时维护
+    uint32_t update_clock_{0};                  // 下一次 update 的时间
+    bool update_scheduled_{false};              // 是否在 container 的定时堆中
+    // 空闲超时记录，由 connection_container 在持锁时维护
+    uint32_t idle_deadline_{0};                 // 超过这个时间没有收到消息则超时关闭
+    std::list<connection*>::iterator idle_iter_;  // 在 container 空闲链表中的位置
 };
 
 };
\ No newline at end of file
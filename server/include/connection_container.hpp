@@ -1,7 +1,16 @@
 #pragma once
 
 #include "util.hpp"
+#include "slab_pool.hpp"
+#include "segment_pool.hpp"
+#include <list>
+#include <mutex>
+#include <vector>
+#include <queue>
+#include <deque>
 #include <unordered_map>
+#include <atomic>
+#include <random>
 
 namespace KCP {
 
@@ -12,17 +21,86 @@ class connection_container {
 public:
     connection_container();
     std::shared_ptr<connection> findByConv(const uint32_t& conv);
+    // 查找该地址上已建立的连接，用于去重重复的握手请求
+    std::shared_ptr<connection> findByAddr(const struct sockaddr_in& addr);
 
-    void update(uint32_t clock);
-    void stop();
+    // 只 update 定时已到的连接，返回距离下一次需要 update 的毫秒数（kcp 定时或空闲超时），-1 表示没有任何定时任务
+    // 死链和超时的连接通知上层后放入 closed，由调用方批量发断开通知并在锁外释放；
+    // 每次最多关闭 KCP_DISCONNECT_BATCH 个，剩下的下一轮立即处理，大量同时超时不会卡住定时器
+    int update(uint32_t clock, std::vector<std::shared_ptr<connection>>& closed);
+    // 所有连接都没有待发送/待确认的数据
+    bool drained();
+    // 取出所有连接并清空，由调用方批量发断开通知后释放
+    std::vector<std::shared_ptr<connection>> stop();
     
-    std::shared_ptr<connection> addConnection(std::weak_ptr<connection_manager> manager, const uint32_t conv, const struct sockaddr_in* addr);
+    // 分配一个空闲槽位生成 conv 并创建连接，槽位用完时返回空
+    std::shared_ptr<connection> addConnection(std::weak_ptr<connection_manager> manager, const struct sockaddr_in* addr, uint32_t clock);
     void removeConnection(const uint32_t& conv);
-    
-    uint32_t getNewConv() const;
+    // 会话恢复：conv 的槽位关闭不久且还没被复用时返回 true 并取出原会话随机数，用于校验恢复票据
+    bool resumeNonce(const uint32_t conv, uint32_t clock, uint64_t& nonce);
+    // 会话恢复：conv 的槽位关闭不久且还没被复用时，用原 conv 和原会话随机数重建连接
+    // kcp 序号按客户端带来的状态对齐：snd_nxt 为客户端期望收到的序号，rcv_nxt 为客户端第一个未确认的序号
+    std::shared_ptr<connection> resumeConnection(std::weak_ptr<connection_manager> manager, const uint32_t conv, const struct sockaddr_in* addr, uint32_t clock, uint32_t snd_nxt, uint32_t rcv_nxt);
+
+    // 热重启：取出所有连接用于序列化
+    std::vector<std::shared_ptr<connection>> snapshot();
+    // 热重启：用旧进程交过来的 kcp 状态重建连接，放回 conv 对应的槽位，状态无效或槽位已被占用时返回空
+    std::shared_ptr<connection> restoreConnection(std::weak_ptr<connection_manager> manager, const uint32_t conv, const struct sockaddr_in* addr, uint64_t nonce, const std::string& kcp_state, uint32_t clock);
+
+    // 收到客户端消息时刷新超时时间，并移到空闲链表尾部 O(1)
+    void touch(const std::shared_ptr<connection>& conn, uint32_t clock);
+    // NAT 重绑定：连接切换到新地址，同时更新地址索引
+    void migrate(const std::shared_ptr<connection>& conn, const struct sockaddr_in& addr);
+    // 安排连接在 clock 时 update（收包/send 后调用），已安排了更早的时间则忽略
+    void schedule(const std::shared_ptr<connection>& conn, uint32_t clock);
+    // 空闲多久后休眠连接（ms），0 关闭休眠
+    void setHibernateAfter(uint32_t hibernate_after) { hibernate_after_ = hibernate_after; }
+
+private:
+    // 从空闲链表头部弹出最多 max_count 个已超时的连接，未超时的连接不会被访问
+    std::vector<std::shared_ptr<connection>> popExpired(uint32_t clock, size_t max_count);
+    // 以下持锁调用
+    void scheduleLocked(connection* conn, uint32_t clock);
+
+    // conv = 代数 << KCP_CONV_SLOT_BITS | 槽位下标，槽位重新分配时代数加一
+    // 释放时保留代数，关闭不久的会话可以凭原 conv 恢复
+    struct conn_slot {
+        uint32_t generation{0};
+        bool free{false};
+        uint32_t closed_clock{0};
+        uint64_t nonce{0};          // 关闭时保留会话随机数，供会话恢复校验票据
+        std::shared_ptr<connection> conn;
+    };
+    conn_slot* findLocked(uint32_t conv);
+    // conv 的槽位关闭不久、代数一致且还没被复用
+    conn_slot* resumableLocked(uint32_t conv, uint32_t clock);
+    void releaseLocked(uint32_t conv);
+    void attachLocked(conn_slot& slot, const std::shared_ptr<connection>& conn, uint32_t clock);
+
+    struct update_timer {
+        uint32_t clock;
+        uint32_t conv;
+    };
+    // 小顶堆比较，时间可能回绕，用差值比较
+    struct update_timer_later {
+        bool operator()(const update_timer& a, const update_timer& b) const { return (int32_t)(a.clock - b.clock) > 0; }
+    };
 
 private:
-    std::unordered_map<uint32_t, std::shared_ptr<connection>> connections_;
+    std::mutex mutex_;  // 保护以下成员，recv 线程与 update 线程共用
+    std::vector<conn_slot> slots_;          // 按 conv 低位直接下标访问
+    // 可复用的槽位下标，先进先出，刚关闭的槽位最晚复用，给会话恢复留时间
+    // 槽位被恢复后留在队列中的旧下标惰性跳过
+    std::deque<uint32_t> free_slots_;
+    std::shared_ptr<slab_pool> slab_;       // connection 对象连续分配在 slab 中
+    std::shared_ptr<segment_pool> segments_;    // 本 container 所有 ikcpcb 的分片和缓冲区
+    std::unordered_map<uint64_t, uint32_t> addr_convs_;    // addrKey -> conv
+    // 按超时时间升序排列：表头是最久没有收到消息的连接
+    std::list<connection*> idle_list_;
+    // 按下一次 update 时间排序的定时堆，连接重新安排后旧的记录惰性丢弃
+    std::priority_queue<update_timer, std::vector<update_timer>, update_timer_later> update_timers_;
+    std::atomic<uint32_t> hibernate_after_{KCP_HIBERNATE_AFTER};
+    std::mt19937_64 nonce_rng_;             // 会话随机数，持锁使用
 };
 
-};
\ No newline at end of file
+};
@@ -1,6 +1,12 @@
 #pragma once
 
 #include "util.hpp"
+#include "clock_service.hpp"
+#include "handshake_cookie.hpp"
+#include "admission_control.hpp"
+#include "disconnect_batch.hpp"
+
+#include <sys/uio.h>
 
 #include <functional>
 #include <thread>
@@ -9,14 +15,18 @@
 #include <queue>
 #include <condition_variable>
 #include <mutex>
+#include <string>
 
 namespace KCP {
 
 class connection_container;
+class connection;
 
 class connection_manager : public std::enable_shared_from_this<connection_manager> {
 public:
-    connection_manager(const int port);
+    // hot_restart_path 不为空时开启热重启：先尝试从该路径上的旧进程接管 socket 和连接，
+    // 没有旧进程时正常绑定端口；之后在该路径上等待下一个新进程
+    connection_manager(const int port, const std::string& hot_restart_path = "");
     ~connection_manager();
 
     // 创建完实例后，先调用这个函数，确定 sockfd 是否可用
@@ -25,46 +35,129 @@ public:
     // user call this function to run server
     void run();
     // user call this function to stop server
+    // 先进入排空模式：拒绝新的握手和会话恢复，已有连接继续收发直到未确认数据都被确认或超过排空时间，
+    // 然后停止收发线程，再分批关闭连接并通知客户端
     void stop();
+    // 排空最长等待时间（ms），0 表示 stop 时直接关闭，默认 KCP_DRAIN_TIMEOUT
+    void setDrainTimeout(uint32_t drain_ms) { drain_timeout_ = drain_ms; }
 
     // timeout to disconnect client.
     void forceDisconnect(const uint32_t& conv);
+    // 固定某个连接的 kcp update 间隔（ms），0 恢复默认间隔；空闲连接本身不再定时 update，不需要退避
+    int setUpdateInterval(const uint32_t& conv, int interval_ms);
 
     void setCallback(const std::function<event_callback_t>& func);
+    // 零拷贝收包：消息不再拷贝成 string，直接把 kcp 分片交给回调，和 setCallback 一样在 run 之前设置
+    void setRecvViewCallback(const std::function<recv_view_callback_t>& func);
+    // 握手准入限速参数，默认值见 util.hpp
+    void setHandshakeLimits(const handshake_limits& limits) { admission_.setLimits(limits); }
+    handshake_stats getHandshakeStats() const { return admission_.getStats(); }
+    // 低延迟发送模式：send 后立即 flush，不等下一次 update；
+    // 在回调（同一批收包处理）中多次 send 只在这批处理完后 flush 一次，
+    // 其它线程的 send 唤醒 update 线程，在它的下一轮循环中合并 flush
+    void setLowLatencySend(bool enable) { low_latency_send_ = enable; }
+    // 空闲连接休眠：收发队列都空且 hibernate_after ms 没有流量时释放 ikcpcb，下次收包或 send 时重建；0 关闭
+    void setHibernateAfter(uint32_t hibernate_after);
 
     // send by kcp
+    // 长消息零拷贝：kcp 分片引用 msg 的内容直到全部被确认，调用后不要再修改 msg
     int send(const uint32_t& conv, std::shared_ptr<std::string> msg);
+    // 分散发送：iov 的各段（如消息头、消息体、消息尾）作为一条消息直接分片进 kcp，不用先拼接；
+    // 调用返回时数据已拷贝进分片，iov 可以立即复用；分片失败返回 KCP_ERR_SEND_FAILED
+    int sendv(const uint32_t& conv, const struct iovec* iov, int iovcnt);
     // send by udp
     void sendByUdp(const char* buf, int len, struct sockaddr_in& addr);
     
     void callCallBack(const uint32_t conv, eEventType event_type, std::shared_ptr<std::string> msg);
+    bool hasRecvView() const { return static_cast<bool>(recv_view_callback_); }
+    void callRecvView(const uint32_t conv, std::shared_ptr<const std::string_view> msg);
 
-    uint32_t getCurClock() const { return cur_clock_.load(); };
+    // 缓存时钟，只在 recv/update 线程或入口处 tick 过之后使用
+    uint32_t getCurClock() const { return clock_service::now(); };
 private:
     void recv();
     void update();
-
+    // 有新的 kcp 数据需要驱动时通知 update 线程，它会在一个 kcp 间隔内醒来时只打标记不 notify；
+    // immediate 为 true 时总是 notify
+    void wakeUpdate(bool immediate = false);
+    // flush 本批收包处理中有待回 ack 或低延迟 send 过的连接，ack 和数据合并发送，只在 recv 线程调用
+    void flushPending();
+    // flush 两轮 update 之间在 recv 线程之外低延迟 send 过的连接，只在 update 线程调用
+    void flushAsync();
+    // send 之后：加入定时堆，低延迟模式下 flush 或登记到本批处理结束时 flush
+    void afterSend(const std::shared_ptr<connection>& conn);
+
+    // 处理控制包：connect 只回 cookie，cookie echo 验证通过并通过准入控制才建立连接
+    void processCtrlMsg(eCtrlType type, const std::string& recv_msg, struct sockaddr_in* addr);
     void processConnection(struct sockaddr_in*);
-    void processKcpMsg(const std::string& recv_msg);
+    void sendAccept(const std::shared_ptr<connection>& conn, struct sockaddr_in* addr);
+    void processKcpMsg(const std::string& recv_msg, struct sockaddr_in* addr);
+    // 收到迁移令牌，验证通过后把连接切换到新地址
+    void processMigrate(const std::string& recv_msg, struct sockaddr_in* addr);
+    // 会话恢复：连接还在时等同迁移，刚关闭时按客户端的序号重建，失败回 disconnect 让客户端重新握手
+    void processResume(const std::string& recv_msg, struct sockaddr_in* addr);
+    bool verifyMigrateToken(uint32_t conv, uint64_t nonce, const char* token) const;
+
+    // 热重启：新进程连上来时交出 socket 和连接状态，等新进程确认后停止本进程的服务，不通知客户端断开；
+    // 交接失败或等确认超时时恢复 recv/update 线程继续服务
+    void handOff();
+    // 热重启：构造时从旧进程接管 socket，连接状态暂存，run 开始收包前恢复并确认
+    bool takeOver();
+    void restoreState();
+    // 热重启：监听新进程的连接；接管中的进程要等旧进程提交后再监听，交接失败时路径仍归旧进程
+    void listenHotRestart();
+    std::string snapshotState(const std::vector<std::shared_ptr<connection>>& conns) const;
+    // 启动 recv/update 线程；热重启交接失败时停掉后重新启动
+    void startWorkers();
+    // stop 的实现，drain_ms 为 0 时不排空；析构时用 0
+    void shutdown(uint32_t drain_ms);
+    // 停止并回收 recv/update 线程
+    void stopWorkers();
+    // 批量发断开通知（一次 sendmmsg）后释放连接，只在 update 线程或工作线程都已停止后调用
+    void closeConnections(std::vector<std::shared_ptr<connection>> conns);
 
 private:
     void initServer(const int& port);
+    void initEpoll();
 
 private:
     std::atomic<bool> stopped_{false};
-    std::atomic<uint32_t> cur_clock_{};
+    std::atomic<bool> draining_{false};     // stop 已开始，不再接受新连接
+    std::atomic<uint32_t> drain_timeout_{KCP_DRAIN_TIMEOUT};
 
     std::vector<std::thread> threads_;
 
     std::function<event_callback_t> event_callback;
+    std::function<recv_view_callback_t> recv_view_callback_;
 
     int sockfd_{0};
     int epoll_fd_{0};
+    int wakeup_fd_{-1};     // eventfd，stop 时唤醒阻塞在 epoll_wait 中的 run
+    std::string hot_restart_path_;
+    int hot_restart_fd_{-1};        // 等待新进程连接的 unix socket
+    int hot_restart_peer_{-1};      // 接管中与旧进程的连接，run 中确认接管后关闭
+    std::string restore_state_;     // 从旧进程接管的连接状态，run 开始时恢复
 
     std::queue<std::pair<std::string, struct sockaddr_in>> recv_que_;
     std::mutex mtx_;
     std::condition_variable cv_;
 
+    // update 线程按最近的 kcp 定时睡眠，没有定时任务时一直挂起直到被唤醒
+    std::mutex update_mtx_;
+    std::condition_variable update_cv_;
+    bool update_wake_{false};           // 以下三项由 update_mtx_ 保护
+    bool update_parked_{false};
+    uint32_t next_update_clock_{0};
+
+    std::atomic<bool> low_latency_send_{false};
+    std::vector<std::shared_ptr<connection>> pending_flush_;   // 只在 recv 线程访问
+    std::mutex async_flush_mtx_;
+    std::vector<std::shared_ptr<connection>> async_flush_;     // recv 线程之外 send 过的连接，由 async_flush_mtx_ 保护
+
+    disconnect_batch disconnects_;      // 只在 update 线程或 stop 中访问
+    handshake_cookie cookie_;
+    admission_control admission_;
+
     std::unique_ptr<connection_container> connection_;
 };
 
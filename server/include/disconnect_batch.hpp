@@ -0,0 +1,29 @@
+#pragma once
+
+#include "util.hpp"
+
+#include <vector>
+#include <sys/socket.h>
+
+namespace KCP {
+
+// 批量发送断开通知：控制包写进预分配的缓冲区，攒满一批或 flush 时用一次 sendmmsg 发出，
+// 大量连接同时超时或 stop 时不再每个连接一次 sendto
+class disconnect_batch {
+public:
+    explicit disconnect_batch(size_t capacity = KCP_DISCONNECT_BATCH);
+
+    // 加入一个连接的断开通知，攒满一批时自动发出
+    void add(int sockfd, uint32_t conv, uint64_t addr_key);
+    // 发出已攒的通知，断开通知尽力而为，发送缓冲区满时丢弃剩余部分
+    void flush(int sockfd);
+
+private:
+    std::vector<char> buffers_;                 // capacity * KCP_CTRL_MAX_SIZE
+    std::vector<struct sockaddr_in> addrs_;
+    std::vector<struct iovec> iovs_;
+    std::vector<struct mmsghdr> msgs_;
+    size_t count_{0};
+};
+
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "util.hpp"
+#include <cstdint>
+
+namespace KCP {
+
+// 无状态握手 cookie：mac = SipHash-2-4(secret, ip | port | 签发时间)
+// 服务端收到 connect 只回 cookie，不保存状态；client 带回有效 cookie 才分配 conv 和 ikcpcb，
+// 伪造源地址的洪泛拿不到 cookie，无法消耗内存和 conv
+class handshake_cookie {
+public:
+    handshake_cookie();
+
+    // 生成 KCP_COOKIE_SIZE 字节的 cookie
+    void generate(const struct sockaddr_in& addr, uint32_t clock, char* cookie) const;
+    // 校验 cookie 是否由本进程为该地址签发且未过期
+    bool verify(const struct sockaddr_in& addr, uint32_t clock, const char* cookie, int len) const;
+    // 迁移令牌，由 secret、conv 和会话随机数派生；conv 复用（代数回绕、热重启后重新分配）后旧令牌失效
+    uint64_t migrateToken(uint32_t conv, uint64_t nonce) const;
+    // 热重启时把 secret 交给新进程，已签发的 cookie 和迁移令牌继续有效
+    void exportKey(uint64_t key[2]) const { key[0] = key_[0]; key[1] = key_[1]; }
+    void importKey(const uint64_t key[2]) { key_[0] = key[0]; key_[1] = key[1]; }
+
+private:
+    uint64_t mac(const struct sockaddr_in& addr, uint32_t issue_clock) const;
+
+private:
+    uint64_t key_[2]{};    // 启动时随机生成
+};
+
+};
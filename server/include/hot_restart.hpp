@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+
+namespace KCP {
+
+// 热重启：新进程启动时连接旧进程监听的 unix socket，旧进程用 SCM_RIGHTS 把 UDP socket 交过去，
+// 随后发送序列化的连接状态（4 字节长度 + 数据），新进程接着服务，客户端只感受到短暂停顿。
+// 新进程恢复连接后回确认，旧进程收到确认才停止服务并回提交，新进程收到提交才开始收包；
+// 任一步超时（KCP_HOT_RESTART_TIMEOUT）或断开，旧进程继续服务，新进程放弃接管。
+// 状态里有 cookie 密钥，双方都要求对端与本进程是同一个 uid
+
+// 旧进程：在 path 上监听新进程的连接，返回非阻塞的监听 fd，失败返回 -1
+int listenHandOff(const std::string& path);
+// 旧进程：接受新进程的连接，对端不是同一个 uid 时拒绝，返回 -1
+int acceptHandOff(int listen_fd);
+// 旧进程：把 udp_fd 和 state 交给已连上来的新进程，新进程确认接管后才返回 true
+bool sendHandOff(int sock, int udp_fd, const std::string& state);
+// 旧进程：已停止服务，通知新进程开始收包
+bool commitHandOff(int sock);
+// 新进程：连接旧进程取回 UDP socket 和连接状态，sock 保持打开用于之后的确认；没有旧进程或交接失败返回 -1
+int recvHandOff(const std::string& path, std::string& state, int& sock);
+// 新进程：连接已恢复，回确认并等待旧进程提交，返回 false 时旧进程仍在服务，本进程不能接管；sock 在这里关闭
+bool confirmHandOff(int sock);
+
+};
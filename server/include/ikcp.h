@@ -279,10 +279,36 @@ struct IKCPSEG
 	IUINT32 rto;
 	IUINT32 fastack;
 	IUINT32 xmit;
+	IUINT32 heap_index;				// slot in snd_heap while in snd_buf
+	struct IQUEUEHEAD fast_node;	// linked into snd_fast when fastack >= fastresend
+	struct IKCPREF *ref;			// zero-copy: payload is 'ext' inside ref's buffer
+	const char *ext;
 	char data[1];
 };
 
 
+//---------------------------------------------------------------------
+// IKCPALLOC: per-kcp allocator, release gets back the requested size
+// so size-classed pools need no block header
+//---------------------------------------------------------------------
+struct IKCPALLOC
+{
+	void *(*alloc)(size_t size, void *ctx);
+	void (*release)(void *ptr, size_t size, void *ctx);
+	void *ctx;
+};
+
+
+//---------------------------------------------------------------------
+// IKCPVEC: one buffer of a scatter-gather send
+//---------------------------------------------------------------------
+struct IKCPVEC
+{
+	const char *data;
+	int len;
+};
+
+
 //---------------------------------------------------------------------
 // IKCPCB
 //---------------------------------------------------------------------
@@ -302,12 +328,26 @@ struct IKCPCB
 	struct IQUEUEHEAD snd_queue;
 	struct IQUEUEHEAD rcv_queue;
 	struct IQUEUEHEAD snd_buf;
-	struct IQUEUEHEAD rcv_buf;
+	// snd_buf segments as a min-heap on resendts, and the fast retransmit 
+	// candidates, so ikcp_flush only touches segments that are due
+	struct IKCPSEG **snd_heap;
+	IUINT32 snd_heap_size, snd_heap_block;
+	struct IQUEUEHEAD snd_fast;
+	// snd_buf segments indexed by sn & (snd_ring_size - 1), covers [snd_una, snd_nxt)
+	struct IKCPSEG **snd_ring;
+	IUINT32 snd_ring_size;
+	// receive buffer: ring indexed by sn & (rcv_ring_size - 1), the size being
+	// rcv_wnd rounded up to a power of two; holds the
+	// out-of-order segments in [rcv_nxt, rcv_nxt + rcv_wnd), allocated on first data
+	struct IKCPSEG **rcv_ring;
+	IUINT32 *rcv_ring_map;		// presence bitmap, one bit per ring slot
+	IUINT32 rcv_ring_size;
 	IUINT32 *acklist;
 	IUINT32 ackcount;
 	IUINT32 ackblock;
 	void *user;
-	char *buffer;
+	const struct IKCPALLOC *allocator;	// NULL: global ikcp_allocator hooks
+	char *buffer;		// private flush buffer, NULL while the per-thread one fits mtu
 	int fastresend;
 	int fastlimit;
 	int nocwnd, stream;
@@ -318,6 +358,8 @@ struct IKCPCB
 
 
 typedef struct IKCPCB ikcpcb;
+typedef struct IKCPALLOC ikcpalloc;
+typedef struct IKCPVEC ikcpvec;
 
 #define IKCP_LOG_OUTPUT			1
 #define IKCP_LOG_INPUT			2
@@ -345,6 +387,10 @@ extern "C" {
 // output callback can be setup like this: 'kcp->output = my_udp_output'
 ikcpcb* ikcp_create(IUINT32 conv, void *user);
 
+// same as ikcp_create, but the control block and everything it allocates
+// later come from 'allocator', which must outlive the kcp. NULL = global
+ikcpcb* ikcp_create_ex(IUINT32 conv, void *user, const ikcpalloc *allocator);
+
 // release kcp control object
 void ikcp_release(ikcpcb *kcp);
 
@@ -355,9 +401,28 @@ void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len,
 // user/upper level recv: returns size, returns below zero for EAGAIN
 int ikcp_recv(ikcpcb *kcp, char *buffer, int len);
 
+// zero-copy recv: takes the next message off the queue as one segment,
+// payload is view->data / view->len. a single fragment is handed over as
+// is, several are gathered into one block. returns size like ikcp_recv
+int ikcp_recv_view(ikcpcb *kcp, struct IKCPSEG **view);
+
+// give a view back, 'allocator' is the one of the kcp it came from; it may
+// be called after that kcp is released
+void ikcp_view_release(const ikcpalloc *allocator, struct IKCPSEG *view);
+
 // user/upper level send, returns below zero for error
 int ikcp_send(ikcpcb *kcp, const char *buffer, int len);
 
+// scatter-gather send: the 'count' buffers are sent as one message and
+// fragmented straight into segments (and the tail segment in stream mode)
+int ikcp_sendv(ikcpcb *kcp, const ikcpvec *vec, int count);
+
+// zero-copy send: segments point into 'buffer' instead of copying it, so it
+// must stay unchanged until release(opaque), which is called exactly once
+// when no segment references it any more (maybe before this returns)
+int ikcp_send_ref(ikcpcb *kcp, const char *buffer, int len, 
+	void (*release)(void *opaque), void *opaque);
+
 // update state (call it repeatedly, every 10ms-100ms), or you can ask 
 // ikcp_check when to call it again (without ikcp_input/_send calling).
 // 'current' - current timestamp in millisec. 
@@ -390,6 +455,9 @@ int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd);
 // get how many packet is waiting to be sent
 int ikcp_waitsnd(const ikcpcb *kcp);
 
+// change internal update timer interval in millisec, clamped to [10, 5000]
+int ikcp_interval(ikcpcb *kcp, int interval);
+
 // fastest: ikcp_nodelay(kcp, 1, 20, 2, 1)
 // nodelay: 0:disable(default), 1:enable
 // interval: internal update timer interval in millisec, default is 100ms 
@@ -406,6 +474,15 @@ void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*));
 // read conv
 IUINT32 ikcp_getconv(const void *ptr);
 
+// serialize state, windows, timers, pending acks and all queued segments.
+// returns the size written, the required size when buffer is NULL, 
+// or -1 when len is too small
+int ikcp_snapshot(const ikcpcb *kcp, char *buffer, int len);
+
+// rebuild a control block from ikcp_snapshot data, NULL on malformed data.
+// output callback must be set again, allocator as in ikcp_create_ex
+ikcpcb* ikcp_restore(const char *buffer, int len, void *user, const ikcpalloc *allocator);
+
 void ikcp_send_msg_check(const char *data, long size);
 
 #ifdef __cplusplus
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "ikcp.h"
+#include "slab_pool.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace KCP {
+
+// kcp 内存池：按大小分级的 slab，每个 container 一个，通过 ikcpalloc 挂到它的每个 ikcpcb 上
+// ikcpcb、分片、ack 列表、收发索引都从这里分配，最大一级正好放下一个满 MTU 的分片，
+// 更大的请求直接走 operator new；块只在池内复用，不还给系统，占用上限就是峰值
+class segment_pool {
+public:
+    segment_pool();
+
+    segment_pool(const segment_pool&) = delete;
+    segment_pool& operator=(const segment_pool&) = delete;
+
+    // 传给 ikcp_create_ex / ikcp_restore，生命周期与 pool 相同
+    const ikcpalloc* allocator() const { return &allocator_; }
+
+    void* allocate(size_t size);
+    void deallocate(void* ptr, size_t size);
+
+private:
+    // 返回 size 所在的级别，超过最大一级返回 -1
+    int sizeClass(size_t size) const;
+
+    static void* allocHook(size_t size, void* ctx);
+    static void releaseHook(void* ptr, size_t size, void* ctx);
+
+private:
+    std::vector<size_t> class_sizes_;
+    std::vector<std::unique_ptr<slab_pool>> classes_;
+    ikcpalloc allocator_;
+};
+
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace KCP {
+
+// 固定大小块的内存池：按页连续分配，释放的块挂到空闲链表复用
+// 块大小由第一次分配决定，之后大小不同的请求直接走 operator new
+class slab_pool {
+public:
+    explicit slab_pool(size_t blocks_per_page = 256);
+    ~slab_pool();
+
+    slab_pool(const slab_pool&) = delete;
+    slab_pool& operator=(const slab_pool&) = delete;
+
+    void* allocate(size_t size);
+    void deallocate(void* ptr, size_t size);
+
+private:
+    void addPage();
+
+private:
+    std::mutex mutex_;
+    size_t block_size_{0};
+    size_t blocks_per_page_;
+    std::vector<char*> pages_;
+    void* free_list_{nullptr};
+};
+
+// 配合 std::allocate_shared 使用，对象和控制块一起放在 slab 中
+// 分配器拷贝持有 pool 的引用计数，保证最后一个对象释放前 pool 不会析构
+template <class T>
+class slab_allocator {
+public:
+    typedef T value_type;
+
+    explicit slab_allocator(std::shared_ptr<slab_pool> pool) : pool_(std::move(pool)) {}
+    template <class U>
+    slab_allocator(const slab_allocator<U>& other) : pool_(other.pool_) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(pool_->allocate(n * sizeof(T))); }
+    void deallocate(T* ptr, size_t n) { pool_->deallocate(ptr, n * sizeof(T)); }
+
+    template <class U>
+    bool operator==(const slab_allocator<U>& other) const { return pool_ == other.pool_; }
+    template <class U>
+    bool operator!=(const slab_allocator<U>& other) const { return pool_ != other.pool_; }
+
+private:
+    template <class U> friend class slab_allocator;
+    std::shared_ptr<slab_pool> pool_;
+};
+
+};
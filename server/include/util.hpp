@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <memory>
 #include <netinet/in.h>
 
@@ -13,13 +14,52 @@ const int KCP_UPDATE_INTERVAL{5}; // ms
 // const int MAX_MSG_SIZE{(1 << 16) - 20 - 8}; // 理论上最大的udp包 64k 实际能发送的最大长度受 MTU 限制，超出部分分片，分片亦造成丢包，需要重传整个包，效率低下
 const int MAX_KCP_MSG_SIZE{(1 << 12) - 6}; // 超过 kcp 内部分片 本机测max_packet_size=4090
 const int MAX_MSG_SIZE{1 << 16};           // 从 kcp 包解析出来的原始消息的最大长度
+const int KCP_SENDV_INLINE{8};            // sendv 不超过这么多段时在栈上转换成 ikcpvec，更多段才分配
+const size_t KCP_ZERO_COPY_MIN{1024};      // 不短于这个长度的消息零拷贝发送，分片直接引用消息内容，更短的拷贝进分片
 const uint32_t IKCP_OVERHEAD{24};
-const uint32_t KCP_CONNECTION_TIMEOUT_DEADLINE{1000*60}; //10s
+const uint32_t KCP_MTU{1400};                  // 与 ikcp.c 默认 MTU 一致，segment_pool 按它分出满 MTU 分片这一级
+// 客户端空闲时每 KCP_KEEPALIVE_INTERVAL 发一个 kcp 窗口探测（WASK）保活，服务端回 WINS
+const uint32_t KCP_KEEPALIVE_INTERVAL{1000*10}; // ms
+// 服务端空闲超时，不依赖客户端是否保活；保活的客户端在这段时间内至少探测几次，不会被误判
+const uint32_t KCP_CONNECTION_TIMEOUT_DEADLINE{1000*60}; // ms
+// kcp 窗口探测命令字，与 ikcp.c 一致；保活探测只有一个 kcp 头
+const char KCP_CMD_WASK{83};
+const char KCP_CMD_WINS{84};
+const uint32_t KCP_PROBE_WND{128};              // 休眠连接回 WINS 时通告的窗口，即 kcp 默认接收窗口
+const uint32_t KCP_HIBERNATE_AFTER{1000*10};     // ms 收发队列都空且这么久没有流量的连接释放 ikcpcb 休眠，0 关闭
+// 死链检测：任一分片重传达到 KCP_DEAD_LINK 次（kcp->state 置 -1），或有未确认数据却这么久没有收到对端任何包，立即回收连接
+const int KCP_DEAD_LINK{10};
+const uint32_t KCP_DEAD_PEER_TIMEOUT{1000*5};   // ms
+// stop 时先排空：等所有连接的未确认数据被确认，最多等这么久；之后分批发断开通知
+const uint32_t KCP_DRAIN_TIMEOUT{1000*3};      // ms，0 表示不排空直接关闭
+const size_t KCP_DISCONNECT_BATCH{256};
+// 热重启交接用的 unix socket 路径
+const char KCP_HOT_RESTART_PATH[]{"/tmp/kcp_server.sock"};
+const uint32_t KCP_HOT_RESTART_TIMEOUT{1000*3}; // ms 交接时每次收发（含等待对方确认）的超时
+const uint32_t KCP_RESUME_WINDOW{1000*30};      // ms 连接关闭后这段时间内可以凭票据恢复会话
+// conv 低 20 位是连接槽位下标，高 12 位是槽位代数，槽位复用后旧 conv 自动失效
+const uint32_t KCP_CONV_SLOT_BITS{20};
+const uint32_t KCP_CONV_MAX_SLOTS{1u << KCP_CONV_SLOT_BITS};
+const uint32_t KCP_CONV_SLOT_MASK{KCP_CONV_MAX_SLOTS - 1};
+const uint32_t KCP_CONV_GENERATION_MASK{(1u << (32 - KCP_CONV_SLOT_BITS)) - 1};
 
-const std::string KCP_CONNECT_PACKET("kcp_connection_packet");
-const uint32_t NOT_KCP_CONNECT_PACK{2^32-1};
-const std::string KCP_SEND_CONV_PACKET("kcp_connection_back_packet conv:");
-const std::string KCP_DISCONNECT_PACKET("kcp_disconnect_packet");
+// 控制包（握手/断开）：4 字节 conv 固定为 0（有效 conv 的代数不为 0，据此与 kcp 包区分）+ 1 字节类型 + 负载
+// 多字节整数与 kcp 一致按小端编码
+const int KCP_CTRL_HEAD_SIZE{5};
+const int KCP_COOKIE_SIZE{12};                  // 4 字节签发时间 + 8 字节 mac
+const uint32_t KCP_COOKIE_LIFETIME{5000};       // ms cookie 有效期
+const int KCP_MIGRATE_TOKEN_SIZE{8};            // accept 时下发，地址变化后凭它迁移连接
+const int KCP_RESUME_SIZE{4 + KCP_MIGRATE_TOKEN_SIZE + 8};   // conv + 票据 + snd_una + rcv_nxt
+const int KCP_CTRL_MAX_SIZE{KCP_CTRL_HEAD_SIZE + KCP_RESUME_SIZE};
+
+// 握手准入控制默认值：速率为每秒个数，burst 为令牌桶容量
+const uint32_t KCP_CHALLENGE_RATE{10000};       // 全局每秒最多回复的 cookie 数
+const uint32_t KCP_CHALLENGE_BURST{20000};
+const uint32_t KCP_HANDSHAKE_RATE{1000};        // 全局每秒最多新建的连接数
+const uint32_t KCP_HANDSHAKE_BURST{2000};
+const uint32_t KCP_HANDSHAKE_IP_RATE{100};      // 单个源 IP 每秒最多新建的连接数（NAT 后多个客户端共用 IP）
+const uint32_t KCP_HANDSHAKE_IP_BURST{200};
+const size_t KCP_HANDSHAKE_IP_TABLE_MAX{65536}; // 最多同时跟踪的源 IP 数
 
 
 namespace KCP {
@@ -31,17 +71,59 @@ namespace KCP {
     };
     const char* eventTypeStr(eEventType event_type);
 
+    // 控制包类型
+    enum eCtrlType {
+        eCtrlNone = 0,          // 不是控制包，按 kcp 包处理
+        eCtrlConnect,           // client -> server 请求连接，服务端不分配任何资源
+        eCtrlChallenge,         // server -> client 返回无状态 cookie
+        eCtrlCookieEcho,        // client -> server 带回 cookie，验证通过才分配连接
+        eCtrlAccept,            // server -> client 返回 conv + 迁移令牌
+        eCtrlDisconnect,        // server -> client 连接已关闭，负载为 conv
+        eCtrlMigrateRequest,    // server -> client 收到该 conv 来自新地址的包，要求出示迁移令牌，负载为 conv
+        eCtrlMigrate,           // client -> server conv + 迁移令牌，验证通过后连接切换到新地址
+        eCtrlResume,            // client -> server conv + 票据（即迁移令牌）+ 客户端 snd_una/rcv_nxt，0-RTT 恢复会话
+    };
+
     /** 消息回调函数
      * @param uint32_t   kcp客户端的唯一标识conv
      * @param eEventType 回调事件的消息类型
      * @param string     回调事件的消息体
      */
     typedef void(event_callback_t)(uint32_t, eEventType, std::shared_ptr<std::string>);
+    /** 零拷贝收包回调，设置后 eRecvMsg 改走这个回调
+     * @param uint32_t    kcp客户端的唯一标识conv
+     * @param string_view 消息内容，直接指向 kcp 分片（多分片的消息先合并成一块），最后一个引用释放时归还内存池
+     */
+    typedef void(recv_view_callback_t)(uint32_t, std::shared_ptr<const std::string_view>);
     
-    bool isRequireConnect(const char* buffer, int len);
-    std::string GenerateSendBackConvMsg(uint32_t conv);
-    std::string GenerateDisconnectMsg(uint32_t conv);
+    // 返回控制包类型，kcp 数据包返回 eCtrlNone
+    eCtrlType getCtrlType(const char* buffer, int len);
+    // 在 buffer 中生成控制包，返回包长度；buffer 至少 KCP_CTRL_HEAD_SIZE + payload_len
+    int encodeCtrlPacket(char* buffer, eCtrlType type, const char* payload, int payload_len);
+    // 生成负载为一个 uint32_t 的控制包（accept/disconnect 带 conv）
+    int encodeCtrlPacket(char* buffer, eCtrlType type, uint32_t value);
+
+    void encode32u(char* p, uint32_t value);
+    uint32_t decode32u(const char* p);
+
+    // 是否是只有一个 kcp 头的保活探测（WASK）
+    bool isKcpProbe(const char* buffer, int len);
+    // 在 buffer 中生成一个不带数据的 kcp 窗口探测包（WASK/WINS），返回 IKCP_OVERHEAD
+    int encodeKcpProbe(char* buffer, uint32_t conv, char cmd, uint32_t wnd, uint32_t ts, uint32_t una);
+
+    // IPv4 地址 + 端口组成的 key
+    inline uint64_t addrKey(const struct sockaddr_in& addr) {
+        return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+    }
+    inline struct sockaddr_in keyAddr(uint64_t key) {
+        struct sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = (uint32_t)(key >> 16);
+        addr.sin_port = (uint16_t)(key & 0xffff);
+        return addr;
+    }
 };
 
 #define KCP_ERR_NOT_EXIST_CONNECTION -1000
 
+#define KCP_ERR_SEND_FAILED -1001
@@ -20,11 +20,13 @@ int main(int argc, char* argv[]) {
         
         // int port = atoi(argv[2]);
         
-        std::shared_ptr<KCP::connection_manager> server(std::make_shared<KCP::connection_manager>(12345));
+        std::shared_ptr<KCP::connection_manager> server(std::make_shared<KCP::connection_manager>(12345, KCP_HOT_RESTART_PATH));
         if (!server->prepared()) { 
             std::cout << "server prepare failed." << std::endl; 
             return -1;
         }
+        // echo 回包在回调中 send，开启低延迟模式，这批消息处理完立即发出，不等下一次 update
+        server->setLowLatencySend(true);
         server->setCallback([&server](uint32_t conv, KCP::eEventType etype, std::shared_ptr<std::string> msg) {
             std::cout << "recv msg: " << etype << " " << msg->c_str() << std::endl;
             if (etype == KCP::eRecvMsg) {
@@ -42,6 +44,8 @@ int main(int argc, char* argv[]) {
         });
 
         server->run();
+        // 热重启交接给新进程后 run 直接返回，结束等待信号的线程
+        g_stopped.store(true);
 
         stop_wg.join();
     } catch (std::exception& e) {
@@ -0,0 +1,89 @@
+#include "../include/admission_control.hpp"
+
+#include <algorithm>
+
+namespace KCP {
+
+void admission_control::setLimits(const handshake_limits& limits) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    limits_ = limits;
+}
+
+bool admission_control::allowChallenge(uint32_t clock) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!take(challenge_bucket_, clock, limits_.challenge_rate, limits_.challenge_burst)) {
+        ++challenges_dropped_;
+        return false;
+    }
+    ++challenges_sent_;
+    return true;
+}
+
+admission_control::eAdmission admission_control::allowAccept(const struct sockaddr_in& addr, uint32_t clock) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = ip_buckets_.find(addr.sin_addr.s_addr);
+    if (iter == ip_buckets_.end()) {
+        if (ip_buckets_.size() >= KCP_HANDSHAKE_IP_TABLE_MAX)
+            sweepIdleLocked(clock);
+        if (ip_buckets_.size() >= KCP_HANDSHAKE_IP_TABLE_MAX) {
+            ++ip_rate_limited_;
+            return eIpLimited;
+        }
+        iter = ip_buckets_.emplace(addr.sin_addr.s_addr, token_bucket()).first;
+    }
+    // 先看单 IP 再扣全局令牌，避免单个 IP 的洪泛耗尽全局额度
+    if (!take(iter->second, clock, limits_.ip_rate, limits_.ip_burst)) {
+        ++ip_rate_limited_;
+        return eIpLimited;
+    }
+    if (!take(accept_bucket_, clock, limits_.accept_rate, limits_.accept_burst)) {
+        // 归还单 IP 令牌，被全局限速的请求不占用该 IP 的额度
+        iter->second.tokens += 1;
+        ++global_rate_limited_;
+        return eGlobalLimited;
+    }
+    ++accepted_;
+    return eAdmitted;
+}
+
+handshake_stats admission_control::getStats() const {
+    handshake_stats stats;
+    stats.challenges_sent = challenges_sent_.load();
+    stats.challenges_dropped = challenges_dropped_.load();
+    stats.cookies_invalid = cookies_invalid_.load();
+    stats.accepted = accepted_.load();
+    stats.deduplicated = deduplicated_.load();
+    stats.global_rate_limited = global_rate_limited_.load();
+    stats.ip_rate_limited = ip_rate_limited_.load();
+    return stats;
+}
+
+bool admission_control::take(token_bucket& bucket, uint32_t clock, uint32_t rate, uint32_t burst) {
+    if (!bucket.inited) {
+        bucket.inited = true;
+        bucket.tokens = burst;
+        bucket.last_clock = clock;
+    }
+    int32_t elapsed = (int32_t)(clock - bucket.last_clock);
+    if (elapsed > 0) {
+        bucket.tokens = std::min((double)burst, bucket.tokens + (double)elapsed * rate / 1000);
+        bucket.last_clock = clock;
+    }
+    if (bucket.tokens < 1)
+        return false;
+    bucket.tokens -= 1;
+    return true;
+}
+
+void admission_control::sweepIdleLocked(uint32_t clock) {
+    for (auto iter = ip_buckets_.begin(); iter != ip_buckets_.end();) {
+        token_bucket& bucket = iter->second;
+        int32_t elapsed = (int32_t)(clock - bucket.last_clock);
+        if (bucket.tokens + (double)elapsed * limits_.ip_rate / 1000 >= limits_.ip_burst)
+            iter = ip_buckets_.erase(iter);
+        else
+            ++iter;
+    }
+}
+
+};
@@ -0,0 +1,18 @@
+#include "../include/clock_service.hpp"
+
+#include <time.h>
+
+namespace KCP {
+
+std::atomic<uint32_t> clock_service::s_cur_ms_{0};
+
+uint32_t clock_service::tick() {
+    struct timespec ts{};
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    // kcp 内部时间是 32 位毫秒，回绕由 _itimediff 处理
+    uint32_t ms = (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+    s_cur_ms_.store(ms, std::memory_order_relaxed);
+    return ms;
+}
+
+};
@@ -1,10 +1,14 @@
 #include "../include/connection.hpp"
 #include "../include/ikcp.h"
 #include "../include/connection_manager.hpp"
+#include "../include/clock_service.hpp"
 
 #include <iostream>
 #include <memory>
 #include <string.h>
+#include <algorithm>
+#include <climits>
+#include <vector>
 #include <arpa/inet.h>
 
 namespace KCP {
@@ -17,64 +21,222 @@ connection::~connection() {
     clear();
 }
 
-std::shared_ptr<connection> connection::create(const std::weak_ptr<connection_manager>& manager, const uint32_t conv, const struct sockaddr_in* addr) {
-    std::shared_ptr<connection> conn = std::make_shared<connection>(manager);
+std::shared_ptr<connection> connection::create(const std::weak_ptr<connection_manager>& manager, const uint32_t conv, const struct sockaddr_in* addr, const slab_allocator<connection>& alloc, const std::shared_ptr<segment_pool>& segments) {
+    std::shared_ptr<connection> conn = std::allocate_shared<connection>(alloc, manager);
     if (conn) {
+        conn->segments_ = segments;
         conn->initKcp(conv);
-        ::memcpy(&(conn->addr_), addr, sizeof(*addr));
+        conn->addr_key_ = addrKey(*addr);
+        conn->last_active_clock_ = conn->getCurClock();
+        conn->peer_alive_clock_ = conn->last_active_clock_;
         std::cout << "new connection from: " << inet_ntoa(addr->sin_addr)<< ":" << ntohs(addr->sin_port) << std::endl;
     }
     return conn;
 }
 
-void connection::input(const std::string& msg) {
-    last_recv_msg_clock_ = getCurClock();
-
+bool connection::input(const std::string& msg) {
+    bool ack_pending = false;
     {
         std::lock_guard<std::mutex> lock(mutex_);
+        wakeKcp();
+        // update 线程空闲时可能很久没有调用 ikcp_update，先同步时间，保证 rtt 计算正确
+        kcp_->current = getCurClock();
+        last_active_clock_ = kcp_->current;
+        peer_alive_clock_ = kcp_->current;
         ikcp_input(kcp_, msg.c_str(), msg.length());        
+        ack_pending = kcp_->ackcount > 0;
     }
 
-    {
-        char buffer[MAX_MSG_SIZE]{};
-        int rcv_len = 0;
+    if (auto manager = connection_manager_.lock()) {
+        const bool view = manager->hasRecvView();
+        while (deliver(manager.get(), view)) {}
+    }
+    return ack_pending;
+}
+
+bool connection::deliver(connection_manager* manager, bool view) {
+    if (view) {
+        // 分片由 holder 持有，上层释放最后一个引用时归还内存池；连接先析构也没关系
+        struct view_holder {
+            std::string_view msg;
+            IKCPSEG* seg{nullptr};
+            std::shared_ptr<segment_pool> segments;
+            ~view_holder() { ikcp_view_release(segments ? segments->allocator() : nullptr, seg); }
+        };
+        IKCPSEG* seg = nullptr;
         {
             std::lock_guard<std::mutex> lock(mutex_);
-            rcv_len = ikcp_recv(kcp_, buffer, sizeof(buffer));
-        }
-        if (rcv_len <= 0) {
-            // std::cout << "kcp_recv_len" << rcv_len << " <= 0" << std::endl;
-        } else {
-            const std::string msg_packet(buffer, rcv_len);
-            if (auto manager = connection_manager_.lock()) 
-                manager->callCallBack(conv_, eRecvMsg, std::make_shared<std::string>(msg_packet));
-            std::cout << "conv: " << conv_ << " time: " << last_recv_msg_clock_ << " recv: " << msg_packet << std::endl;
+            if (!kcp_ || ikcp_recv_view(kcp_, &seg) < 0)
+                return false;
         }
+        auto holder = std::make_shared<view_holder>();
+        holder->msg = std::string_view(seg->data, seg->len);
+        holder->seg = seg;
+        holder->segments = segments_;
+        manager->callRecvView(conv_, std::shared_ptr<const std::string_view>(holder, &holder->msg));
+        std::cout << "conv: " << conv_ << " time: " << getCurClock() << " recv: " << holder->msg << std::endl;
+        return true;
+    }
+
+    // 按消息长度直接收进 string，只拷贝一次
+    std::shared_ptr<std::string> msg;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        int size = kcp_ ? ikcp_peeksize(kcp_) : -1;
+        if (size < 0)
+            return false;
+        msg = std::make_shared<std::string>(size, '\0');
+        ikcp_recv(kcp_, &(*msg)[0], size);
     }
+    manager->callCallBack(conv_, eRecvMsg, msg);
+    std::cout << "conv: " << conv_ << " time: " << getCurClock() << " recv: " << *msg << std::endl;
+    return true;
+}
+
+bool connection::keepalive(const std::string& msg) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    peer_alive_clock_ = getCurClock();
+    if (kcp_) {
+        kcp_->current = peer_alive_clock_;
+        ikcp_input(kcp_, msg.c_str(), msg.length());
+        return true;
+    }
+    char probe[IKCP_OVERHEAD];
+    int len = encodeKcpProbe(probe, conv_, KCP_CMD_WINS, KCP_PROBE_WND, peer_alive_clock_, hibernate_state_.rcv_nxt);
+    sendUdpMsg(probe, len);
+    return false;
 }
 
 void connection::send(const std::string& msg) {
     std::lock_guard<std::mutex> lock(mutex_);
+    prepareSend();
     int ret = ikcp_send(kcp_, msg.c_str(), msg.length());
     if (ret < 0) {
         std::cout << "send ret < 0: " << ret << std::endl;
     }
 }
 
-void connection::update(uint32_t clock) {
+void connection::send(const std::shared_ptr<std::string>& msg) {
+    if (msg->size() < KCP_ZERO_COPY_MIN) {
+        send(*msg);
+        return;
+    }
     std::lock_guard<std::mutex> lock(mutex_);
-    ikcp_update(kcp_, clock);
+    prepareSend();
+    int ret = ikcp_send_ref(kcp_, msg->data(), msg->size(), &connection::releasePayload, new std::shared_ptr<std::string>(msg));
+    if (ret < 0) {
+        std::cout << "send ret < 0: " << ret << std::endl;
+    }
 }
 
-bool connection::isTimeout() const {
-    if (last_recv_msg_clock_ == 0) { return false; }
+int connection::sendv(const struct iovec* iov, int iovcnt) {
+    if (iovcnt < 0)
+        return -1;
+    ikcpvec inline_vec[KCP_SENDV_INLINE];
+    std::vector<ikcpvec> heap_vec;
+    ikcpvec* vec = inline_vec;
+    if (iovcnt > KCP_SENDV_INLINE) {
+        heap_vec.resize(iovcnt);
+        vec = heap_vec.data();
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > (size_t)INT_MAX)
+            return -1;
+        vec[i].data = static_cast<const char*>(iov[i].iov_base);
+        vec[i].len = static_cast<int>(iov[i].iov_len);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    prepareSend();
+    int ret = ikcp_sendv(kcp_, vec, iovcnt);
+    if (ret < 0) {
+        std::cout << "send ret < 0: " << ret << std::endl;
+    }
+    return ret;
+}
 
-    return  (getCurClock() - last_recv_msg_clock_) >= KCP_CONNECTION_TIMEOUT_DEADLINE;
+void connection::prepareSend() {
+    wakeKcp();
+    // send 可能来自应用线程，缓存的时钟在 update 线程挂起时可能已经过去几秒，这里重新读取，
+    // 否则失联计时起点偏早，下一次 update 会把正常的连接误判为死链
+    last_active_clock_ = clock_service::tick();
+    // 之前没有在途数据，对端失联的计时从这次发送开始
+    if (ikcp_waitsnd(kcp_) == 0)
+        peer_alive_clock_ = last_active_clock_;
 }
 
-void connection::doTimeout() {
+void connection::resumeSequence(uint32_t snd_nxt, uint32_t rcv_nxt) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    wakeKcp();
+    kcp_->snd_una = snd_nxt;
+    kcp_->snd_nxt = snd_nxt;
+    kcp_->rcv_nxt = rcv_nxt;
+}
+
+int connection::waitSend() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return kcp_ ? ikcp_waitsnd(kcp_) : 0;
+}
+
+void connection::snapshotKcp(std::string& out) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    wakeKcp();
+    out.resize(ikcp_snapshot(kcp_, nullptr, 0));
+    ikcp_snapshot(kcp_, &out[0], out.size());
+}
+
+bool connection::restoreKcp(const std::string& data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ikcpcb* kcp = ikcp_restore(data.c_str(), data.size(), (void*)this, segments_ ? segments_->allocator() : nullptr);
+    if (!kcp || kcp->conv != conv_) {
+        if (kcp)
+            ikcp_release(kcp);
+        return false;
+    }
+    if (kcp_)
+        ikcp_release(kcp_);
+    kcp_ = kcp;
+    kcp_->output = &connection::kcpOutput;
+    if (interval_override_ > 0)
+        ikcp_interval(kcp_, interval_override_);
+    return true;
+}
+
+void connection::flush() {
+    flush_pending_ = false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (kcp_) {
+        // update 线程挂起时 kcp 的时间可能很旧，新分片的 ts/resendts 要用当前时间
+        kcp_->current = getCurClock();
+        ikcp_flush(kcp_);
+    }
+}
+
+int connection::update(uint32_t clock, uint32_t hibernate_after) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!kcp_)
+        return -1;
+    ikcp_update(kcp_, clock);
+    // 重传次数用尽，或有在途数据却长时间收不到对端任何包（包括 ack），不再等空闲超时
+    if (kcp_->state == (IUINT32)-1 || (ikcp_waitsnd(kcp_) > 0 && (int32_t)(clock - peer_alive_clock_) >= (int32_t)KCP_DEAD_PEER_TIMEOUT)) {
+        dead_ = true;
+        return -1;
+    }
+    // 没有待发送/待确认的数据，没有待回的 ack，也不需要窗口探测
+    if (ikcp_waitsnd(kcp_) == 0 && kcp_->ackcount == 0 && kcp_->probe == 0 && kcp_->rmt_wnd != 0) {
+        if (hibernate_after == 0 || !canHibernate())
+            return -1;
+        int32_t idle_ms = (int32_t)(clock - last_active_clock_);
+        if (idle_ms < (int32_t)hibernate_after)
+            return (int32_t)hibernate_after - idle_ms;
+        hibernate();
+        return -1;
+    }
+    return (int)(ikcp_check(kcp_, clock) - clock);
+}
+
+void connection::doTimeout(const std::string& reason) {
     if (auto manager = connection_manager_.lock()) {
-        std::shared_ptr<std::string> msg(new std::string("timeout"));
+        std::shared_ptr<std::string> msg(new std::string(reason));
         manager->callCallBack(conv_, eDisconnect, msg);
     }
 }
@@ -83,17 +245,51 @@ void connection::doTimeout() {
 void connection::initKcp(const uint32_t& conv) {
     conv_ = conv;
 
-    kcp_ = ikcp_create(conv_, (void*)this);
+    kcp_ = ikcp_create_ex(conv_, (void*)this, segments_ ? segments_->allocator() : nullptr);
     kcp_->output = &connection::kcpOutput;
 
-    ikcp_nodelay(kcp_, 1, KCP_UPDATE_INTERVAL, 1, 1);// 设置成1次ACK跨越直接重传, 这样反应速度会更快. 内部时钟5毫秒.
+    ikcp_nodelay(kcp_, 1, interval_override_ > 0 ? interval_override_ : KCP_UPDATE_INTERVAL, 1, 1);// 设置成1次ACK跨越直接重传, 这样反应速度会更快. 内部时钟5毫秒.
+    kcp_->dead_link = KCP_DEAD_LINK;
+}
+
+bool connection::canHibernate() const {
+    return kcp_->nsnd_que == 0 && kcp_->nsnd_buf == 0 && kcp_->nrcv_que == 0 && kcp_->nrcv_buf == 0;
+}
+
+void connection::hibernate() {
+    hibernate_state_.snd_una = kcp_->snd_una;
+    hibernate_state_.snd_nxt = kcp_->snd_nxt;
+    hibernate_state_.rcv_nxt = kcp_->rcv_nxt;
+    hibernate_state_.rmt_wnd = kcp_->rmt_wnd;
+    hibernate_state_.rx_srtt = kcp_->rx_srtt;
+    hibernate_state_.rx_rttval = kcp_->rx_rttval;
+    hibernate_state_.rx_rto = kcp_->rx_rto;
+    ikcp_release(kcp_);
+    kcp_ = nullptr;
+}
+
+void connection::wakeKcp() {
+    if (kcp_)
+        return;
+    initKcp(conv_);
+    kcp_->snd_una = hibernate_state_.snd_una;
+    kcp_->snd_nxt = hibernate_state_.snd_nxt;
+    kcp_->rcv_nxt = hibernate_state_.rcv_nxt;
+    kcp_->rmt_wnd = hibernate_state_.rmt_wnd;
+    kcp_->rx_srtt = hibernate_state_.rx_srtt;
+    kcp_->rx_rttval = hibernate_state_.rx_rttval;
+    kcp_->rx_rto = hibernate_state_.rx_rto;
 }
 
 void connection::clear() {
     std::cout << "clear connection conv: " << conv_ << std::endl;
-    std::string disconnect_msg = GenerateDisconnectMsg(conv_);
-    sendUdpMsg(disconnect_msg.c_str(), disconnect_msg.length());
-    ikcp_release(kcp_);
+    if (!detached_) {
+        char disconnect_msg[KCP_CTRL_MAX_SIZE];
+        int len = encodeCtrlPacket(disconnect_msg, eCtrlDisconnect, conv_);
+        sendUdpMsg(disconnect_msg, len);
+    }
+    if (kcp_)
+        ikcp_release(kcp_);
     kcp_ = nullptr;
     conv_ = 0;
 }
@@ -104,16 +300,29 @@ int connection::kcpOutput(const char* buf, int len, ikcpcb* kcp, void* user) {
     return 0;
 }
 
+void connection::releasePayload(void* opaque) {
+    delete static_cast<std::shared_ptr<std::string>*>(opaque);
+}
+
 void connection::sendUdpMsg(const char* buf, int len) {
     auto manager = connection_manager_.lock();
-    manager->sendByUdp(buf, len, addr_);
+    // manager 析构中时 weak_ptr 已失效，丢弃即可，kcp 会重传或对端超时
+    if (!manager)
+        return;
+    struct sockaddr_in addr = keyAddr(addr_key_.load());
+    manager->sendByUdp(buf, len, addr);
 }
     
+void connection::setUpdateInterval(int interval_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    interval_override_ = interval_ms > 0 ? interval_ms : 0;
+    // 休眠中的连接在 wakeKcp 重建时按 interval_override_ 设置
+    if (kcp_)
+        ikcp_interval(kcp_, interval_override_ > 0 ? interval_override_ : KCP_UPDATE_INTERVAL);
+}
+
 uint32_t connection::getCurClock() const {
-    if (auto manager = connection_manager_.lock()) {
-        return manager->getCurClock();
-    }
-    return 0;
+    return clock_service::now();
 }
 
 };
\ No newline at end of file
@@ -1,58 +1,350 @@
 #include "../include/connection_container.hpp"
 #include "../include/connection.hpp"
+#include "../include/clock_service.hpp"
 
 #include <iostream>
+#include <algorithm>
 
 namespace KCP
 {
 
-connection_container::connection_container() {
+connection_container::connection_container() : slab_(std::make_shared<slab_pool>()), segments_(std::make_shared<segment_pool>()) {
+    std::random_device rd;
+    nonce_rng_.seed(((uint64_t)rd() << 32) | rd());
 
 }
 
 std::shared_ptr<connection> connection_container::findByConv(const uint32_t& conv) {
-    auto iter = connections_.find(conv);
-    if (iter == connections_.end()) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    conn_slot* slot = findLocked(conv);
+    if (!slot) {
         return std::shared_ptr<connection>();
     } else {
-        return iter->second;
+        return slot->conn;
     };
 }
 
-void connection_container::update(uint32_t clock) {
-    for (auto iter = connections_.begin(); iter != connections_.end();) {
-        std::shared_ptr<connection> conn = iter->second;
-        conn->update(clock);
-        if (conn->isTimeout()) {
-            conn->doTimeout();
-            connections_.erase(iter++);
-        } else 
-            ++iter;
+std::shared_ptr<connection> connection_container::findByAddr(const struct sockaddr_in& addr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = addr_convs_.find(addrKey(addr));
+    if (iter == addr_convs_.end())
+        return std::shared_ptr<connection>();
+    conn_slot* slot = findLocked(iter->second);
+    return slot ? slot->conn : std::shared_ptr<connection>();
+}
+
+int connection_container::update(uint32_t clock, std::vector<std::shared_ptr<connection>>& closed) {
+    const uint32_t hibernate_after = hibernate_after_.load();
+    std::vector<std::pair<uint32_t, std::shared_ptr<connection>>> due;
+    std::vector<std::shared_ptr<connection>> dead;
+    bool timers_pending = false;
+    // 持锁只取出定时已到的连接，kcp update 和 sendto 在锁外进行，不阻塞 recv 线程的查找和建连
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (!update_timers_.empty() && (int32_t)(clock - update_timers_.top().clock) >= 0) {
+            update_timer timer = update_timers_.top();
+            update_timers_.pop();
+            conn_slot* slot = findLocked(timer.conv);
+            if (!slot)
+                continue;
+            connection* conn = slot->conn.get();
+            // 已经被重新安排到别的时间的旧记录
+            if (!conn->update_scheduled_ || conn->update_clock_ != timer.clock)
+                continue;
+            conn->update_scheduled_ = false;
+            due.emplace_back(timer.conv, slot->conn);
+        }
+    }
+
+    std::vector<int> wait_ms_list(due.size());
+    for (size_t i = 0; i < due.size(); ++i) {
+        wait_ms_list[i] = due[i].second->update(clock, hibernate_after);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < due.size(); ++i) {
+            conn_slot* slot = findLocked(due[i].first);
+            connection* conn = due[i].second.get();
+            // 锁外 update 期间已被移除
+            if (!slot || slot->conn.get() != conn)
+                continue;
+            if (conn->isDead()) {
+                if (dead.size() >= KCP_DISCONNECT_BATCH) {
+                    // 本轮关闭数已满，下一轮立即处理
+                    scheduleLocked(conn, clock);
+                    timers_pending = true;
+                    continue;
+                }
+                // 对端失联，立即回收，不再占用重传带宽等到空闲超时
+                dead.push_back(slot->conn);
+                idle_list_.erase(conn->idle_iter_);
+                conn->idle_iter_ = idle_list_.end();
+                releaseLocked(due[i].first);
+                continue;
+            }
+            if (wait_ms_list[i] >= 0)
+                scheduleLocked(conn, clock + std::max(1, wait_ms_list[i]));
+        }
     }
+    due.clear();
+
+    // 回调中可能再次访问 container，所以在锁外通知
+    for (auto& conn : dead) {
+        conn->doTimeout("dead link");
+        closed.push_back(std::move(conn));
+    }
+    for (auto& conn : popExpired(clock, KCP_DISCONNECT_BATCH)) {
+        conn->doTimeout("timeout");
+        closed.push_back(std::move(conn));
+    }
+
+    if (timers_pending)
+        return 0;
+    int wait_ms = -1;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!update_timers_.empty())
+        wait_ms = std::max(0, (int32_t)(update_timers_.top().clock - clock));
+    if (!idle_list_.empty()) {
+        int idle_wait_ms = std::max(0, (int32_t)(idle_list_.front()->idle_deadline_ - clock));
+        if (wait_ms < 0 || idle_wait_ms < wait_ms)
+            wait_ms = idle_wait_ms;
+    }
+    return wait_ms;
 }
 
-void connection_container::stop() {
-    connections_.clear();
+bool connection_container::drained() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& slot : slots_) {
+        if (slot.conn && slot.conn->waitSend() > 0)
+            return false;
+    }
+    return true;
+}
+
+std::vector<std::shared_ptr<connection>> connection_container::stop() {
+    std::vector<std::shared_ptr<connection>> conns;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (connection* conn : idle_list_) {
+        conn->idle_iter_ = idle_list_.end();
+    }
+    idle_list_.clear();
+    update_timers_ = decltype(update_timers_)();
+    for (auto& slot : slots_) {
+        if (slot.conn)
+            conns.push_back(std::move(slot.conn));
+    }
+    slots_.clear();
+    free_slots_.clear();
+    addr_convs_.clear();
+    return conns;
 }
 
     
-std::shared_ptr<connection> connection_container::addConnection(std::weak_ptr<connection_manager> manager, const uint32_t conv, const struct sockaddr_in* addr) {
-    std::shared_ptr<connection> conn = connection::create(manager, conv, addr);
-    if (conn) {
-        connections_[conv] = conn;
-        std::cout << "add connection conv: " << conv << std::endl;
+std::shared_ptr<connection> connection_container::addConnection(std::weak_ptr<connection_manager> manager, const struct sockaddr_in* addr, uint32_t clock) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t index = 0;
+    while (!free_slots_.empty() && !slots_[free_slots_.front()].free) {
+        free_slots_.pop_front();
+    }
+    if (!free_slots_.empty()) {
+        index = free_slots_.front();
+        free_slots_.pop_front();
+    } else if (slots_.size() < KCP_CONV_MAX_SLOTS) {
+        index = slots_.size();
+        slots_.emplace_back();
+    } else {
+        std::cout << "add connection failed: no free conv slot" << std::endl;
+        return std::shared_ptr<connection>();
+    }
+    conn_slot& slot = slots_[index];
+    // 代数回绕时跳过 0，保证 conv 不为 0
+    slot.generation = (slot.generation + 1) & KCP_CONV_GENERATION_MASK;
+    if (slot.generation == 0)
+        slot.generation = 1;
+    slot.free = false;
+    const uint32_t conv = (slot.generation << KCP_CONV_SLOT_BITS) | index;
+
+    std::shared_ptr<connection> conn = connection::create(manager, conv, addr, slab_allocator<connection>(slab_), segments_);
+    if (!conn) {
+        slot.free = true;
+        free_slots_.push_back(index);
+        return conn;
     }
+    conn->session_nonce_ = nonce_rng_();
+    attachLocked(slot, conn, clock);
+    std::cout << "add connection conv: " << conv << std::endl;
     return conn;
 }
 
+std::shared_ptr<connection> connection_container::resumeConnection(std::weak_ptr<connection_manager> manager, const uint32_t conv, const struct sockaddr_in* addr, uint32_t clock, uint32_t snd_nxt, uint32_t rcv_nxt) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    conn_slot* slot = resumableLocked(conv, clock);
+    if (!slot)
+        return std::shared_ptr<connection>();
+
+    std::shared_ptr<connection> conn = connection::create(manager, conv, addr, slab_allocator<connection>(slab_), segments_);
+    if (!conn)
+        return conn;
+    conn->resumeSequence(snd_nxt, rcv_nxt);
+    conn->session_nonce_ = slot->nonce;
+    slot->free = false;
+    attachLocked(*slot, conn, clock);
+    std::cout << "resume connection conv: " << conv << std::endl;
+    return conn;
+}
+
+bool connection_container::resumeNonce(const uint32_t conv, uint32_t clock, uint64_t& nonce) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    conn_slot* slot = resumableLocked(conv, clock);
+    if (!slot)
+        return false;
+    nonce = slot->nonce;
+    return true;
+}
+
+connection_container::conn_slot* connection_container::resumableLocked(uint32_t conv, uint32_t clock) {
+    const uint32_t index = conv & KCP_CONV_SLOT_MASK;
+    if (index >= slots_.size())
+        return nullptr;
+    conn_slot& slot = slots_[index];
+    if (!slot.free || slot.generation != (conv >> KCP_CONV_SLOT_BITS) || (int32_t)(clock - slot.closed_clock) > (int32_t)KCP_RESUME_WINDOW)
+        return nullptr;
+    return &slot;
+}
+
+std::vector<std::shared_ptr<connection>> connection_container::snapshot() {
+    std::vector<std::shared_ptr<connection>> conns;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& slot : slots_) {
+        if (slot.conn)
+            conns.push_back(slot.conn);
+    }
+    return conns;
+}
+
+std::shared_ptr<connection> connection_container::restoreConnection(std::weak_ptr<connection_manager> manager, const uint32_t conv, const struct sockaddr_in* addr, uint64_t nonce, const std::string& kcp_state, uint32_t clock) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const uint32_t index = conv & KCP_CONV_SLOT_MASK;
+    if (index < slots_.size() && slots_[index].conn)
+        return std::shared_ptr<connection>();
+    std::shared_ptr<connection> conn = connection::create(manager, conv, addr, slab_allocator<connection>(slab_), segments_);
+    if (!conn)
+        return conn;
+    if (!conn->restoreKcp(kcp_state)) {
+        conn->detach();
+        return std::shared_ptr<connection>();
+    }
+    // 中间空出来的槽位作为空闲槽位，代数为 0 不会被会话恢复误用
+    while (slots_.size() <= index) {
+        free_slots_.push_back(slots_.size());
+        slots_.emplace_back();
+        slots_.back().free = true;
+    }
+    conn_slot& slot = slots_[index];
+    slot.generation = conv >> KCP_CONV_SLOT_BITS;
+    slot.free = false;
+    conn->session_nonce_ = nonce;
+    attachLocked(slot, conn, clock);
+    return conn;
+}
+
+void connection_container::attachLocked(conn_slot& slot, const std::shared_ptr<connection>& conn, uint32_t clock) {
+    conn->idle_deadline_ = clock + KCP_CONNECTION_TIMEOUT_DEADLINE;
+    conn->idle_iter_ = idle_list_.insert(idle_list_.end(), conn.get());
+    slot.conn = conn;
+    addr_convs_[conn->addr_key_.load()] = conn->conv_;
+    scheduleLocked(conn.get(), clock);
+}
+
 void connection_container::removeConnection(const uint32_t& conv) {
-    connections_.erase(conv);
+    // 最后一个引用在锁外释放，析构（发断开通知、释放 kcp）不占用容器锁
+    std::shared_ptr<connection> removed;
+    std::lock_guard<std::mutex> lock(mutex_);
+    conn_slot* slot = findLocked(conv);
+    if (!slot)
+        return;
+    removed = slot->conn;
+    idle_list_.erase(slot->conn->idle_iter_);
+    slot->conn->idle_iter_ = idle_list_.end();
+    releaseLocked(conv);
 }
 
-    
-uint32_t connection_container::getNewConv() const {
-    static uint32_t s_cur_conv = 1000;
-    return ++s_cur_conv;
+void connection_container::touch(const std::shared_ptr<connection>& conn, uint32_t clock) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // 已经被超时清理或移除的连接不再入链表
+    if (conn->idle_iter_ == idle_list_.end())
+        return;
+    conn->idle_deadline_ = clock + KCP_CONNECTION_TIMEOUT_DEADLINE;
+    idle_list_.splice(idle_list_.end(), idle_list_, conn->idle_iter_);
+}
+
+void connection_container::migrate(const std::shared_ptr<connection>& conn, const struct sockaddr_in& addr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (conn->idle_iter_ == idle_list_.end())
+        return;
+    auto iter = addr_convs_.find(conn->addr_key_.load());
+    if (iter != addr_convs_.end() && iter->second == conn->conv_)
+        addr_convs_.erase(iter);
+    conn->addr_key_ = addrKey(addr);
+    addr_convs_[addrKey(addr)] = conn->conv_;
+}
+
+void connection_container::schedule(const std::shared_ptr<connection>& conn, uint32_t clock) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (conn->idle_iter_ == idle_list_.end())
+        return;
+    scheduleLocked(conn.get(), clock);
+}
+
+void connection_container::scheduleLocked(connection* conn, uint32_t clock) {
+    if (conn->update_scheduled_ && (int32_t)(clock - conn->update_clock_) >= 0)
+        return;
+    conn->update_scheduled_ = true;
+    conn->update_clock_ = clock;
+    update_timers_.push(update_timer{clock, conn->conv_});
+}
+
+std::vector<std::shared_ptr<connection>> connection_container::popExpired(uint32_t clock, size_t max_count) {
+    std::vector<std::shared_ptr<connection>> expired;
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (!idle_list_.empty() && expired.size() < max_count) {
+        connection* conn = idle_list_.front();
+        if ((int32_t)(clock - conn->idle_deadline_) < 0)
+            break;
+        idle_list_.pop_front();
+        conn->idle_iter_ = idle_list_.end();
+        conn_slot* slot = findLocked(conn->conv_);
+        if (slot) {
+            expired.push_back(slot->conn);
+            releaseLocked(conn->conv_);
+        }
+    }
+    return expired;
+}
+
+connection_container::conn_slot* connection_container::findLocked(uint32_t conv) {
+    const uint32_t index = conv & KCP_CONV_SLOT_MASK;
+    if (index >= slots_.size())
+        return nullptr;
+    conn_slot& slot = slots_[index];
+    // 槽位被复用后，旧 conv 的包因为代数不同直接丢弃
+    if (!slot.conn || slot.generation != (conv >> KCP_CONV_SLOT_BITS))
+        return nullptr;
+    return &slot;
+}
+
+void connection_container::releaseLocked(uint32_t conv) {
+    const uint32_t index = conv & KCP_CONV_SLOT_MASK;
+    conn_slot& slot = slots_[index];
+    auto iter = addr_convs_.find(slot.conn->addr_key_.load());
+    if (iter != addr_convs_.end() && iter->second == conv)
+        addr_convs_.erase(iter);
+    slot.nonce = slot.conn->session_nonce_;
+    slot.conn.reset();
+    slot.free = true;
+    slot.closed_clock = clock_service::now();
+    free_slots_.push_back(index);
 }
 
 
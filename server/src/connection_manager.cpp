@@ -7,6 +7,7 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 // stream files
 #include <iostream>
@@ -17,9 +18,13 @@
 #include "../include/ikcp.h"
 #include "../include/connection_container.hpp"
 #include "../include/connection.hpp"
+#include "../include/hot_restart.hpp"
 
 namespace KCP {
 
+// 当前线程正在 recv 线程的一批收包处理中，低延迟 send 合并到批次结束时 flush
+static thread_local bool s_in_recv_batch{false};
+
 void signalDisable() {
     // ignore the child terminate signal
     signal(SIGCHLD, SIG_IGN);
@@ -27,39 +32,50 @@ void signalDisable() {
     signal(SIGPIPE, SIG_IGN);
 }
 
-connection_manager::connection_manager(const int port) : connection_(std::make_unique<connection_container>()) {
+connection_manager::connection_manager(const int port, const std::string& hot_restart_path) 
+    : hot_restart_path_(hot_restart_path), connection_(std::make_unique<connection_container>()) {
+    clock_service::tick();
     std::cout << "port: " << port << std::endl;
-    initServer(port);
+    if (hot_restart_path_.empty() || !takeOver())
+        initServer(port);
     if (!sockfd_) return;
+    if (!hot_restart_path_.empty() && hot_restart_peer_ < 0)
+        listenHotRestart();
 
-    {
-        // 开启kcp缓冲区定时刷新
-        std::function<void()> update_task([this]{ this->update(); });
-        threads_.push_back(std::thread(std::move(update_task)));
-
-        // 开启处理接收到的消息
-        std::function<void()> process_recv_msg_task([this]{ this->recv(); });
-        threads_.push_back(std::thread(std::move(process_recv_msg_task)));
-        // std::function<void()> process_recv_task = std::bind(&connection_manager::recv, this);
-        // threads_.push_back(std::thread(process_recv_task));
-    }
+    startWorkers();
 
     signalDisable();
 }
 
 connection_manager::~connection_manager() {
     if (!stopped_) {
-        stop();
+        // 析构时 weak_ptr 已经失效，连接不能再通过 manager 发包，不排空直接关闭
+        shutdown(0);
     }
 }
 
 void connection_manager::run() {
     std::cout << "kcp server start running..." << std::endl;
+    restoreState();
+    if (hot_restart_peer_ >= 0) {
+        // 连接已恢复、socket 已在 epoll 中，确认后旧进程才停止服务；拿不到提交说明旧进程仍在服务，放弃接管
+        const bool committed = confirmHandOff(hot_restart_peer_);
+        hot_restart_peer_ = -1;
+        if (!committed) {
+            for (auto& conn : connection_->snapshot()) {
+                conn->detach();
+            }
+            connection_->stop();
+            shutdown(0);
+            return;
+        }
+        listenHotRestart();
+    }
     struct sockaddr_in addr{};
     socklen_t addr_len = sizeof(addr);
     while (!stopped_) {
         epoll_event events[SOMAXCONN];
-        int nfds = epoll_wait(epoll_fd_, events, SOMAXCONN, 10);
+        int nfds = epoll_wait(epoll_fd_, events, SOMAXCONN, -1);
         if (nfds == -1) {
             if (errno == EINTR) {
                 std::cout << "epoll_wait interrupted by signal" << std::endl; // gdb ctrl+c
@@ -72,6 +88,10 @@ void connection_manager::run() {
             continue; //timeout todo something not busy
         } else {
             for (int i = 0; i < nfds; ++i) {
+                if (events[i].data.fd == hot_restart_fd_) {
+                    handOff();
+                    break;
+                }
                 if (events[i].data.fd == sockfd_) {
                     while (true) { // et 模式必须一次性读完，防止丢包
                         std::vector<char> recv_data(MAX_KCP_MSG_SIZE, '\0');
@@ -81,7 +101,7 @@ void connection_manager::run() {
                             std::unique_lock<std::mutex> msg_lock(mtx_);
                             recv_que_.push(msg);
                             cv_.notify_one();
-                        } else if (recv_len == 0) {
+                        } else { // EAGAIN 读完了
                             break;
                         }
                     }
@@ -105,24 +125,211 @@ void connection_manager::run() {
 
 // stop
 void connection_manager::stop() {
+    shutdown(drain_timeout_.load());
+}
+
+void connection_manager::shutdown(uint32_t drain_ms) {
+    if (draining_.exchange(true))
+        return;
     std::cout << "kcp_stop start: " << std::endl;
-    stopped_.store(true);
-    connection_->stop();
+    // 收发线程继续运行，update 线程负责重传，直到所有在途数据被确认
+    // stop 在应用线程调用，update 线程可能挂起，自己刷新时钟
+    const uint32_t drain_deadline = clock_service::tick() + drain_ms;
+    while ((int32_t)(drain_deadline - clock_service::tick()) > 0 && !connection_->drained()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(KCP_UPDATE_INTERVAL));
+    }
+
+    stopWorkers();
+
+    // recv/update 线程已经退出，不会再访问连接；断开通知在关闭 socket 之前批量发出
+    closeConnections(connection_->stop());
     if (sockfd_ > 0) {
         ::close(sockfd_);
         sockfd_ = 0;
     }
+    if (hot_restart_fd_ >= 0) {
+        ::close(hot_restart_fd_);
+        hot_restart_fd_ = -1;
+        ::unlink(hot_restart_path_.c_str());
+    }
+    if (hot_restart_peer_ >= 0) {
+        // 没有 run 就停止，旧进程等不到确认，继续服务
+        ::close(hot_restart_peer_);
+        hot_restart_peer_ = -1;
+    }
+    std::cout << "kcp stopped." << std::endl;
+}
+
+void connection_manager::startWorkers() {
+    // 开启kcp缓冲区定时刷新
+    std::function<void()> update_task([this]{ this->update(); });
+    threads_.push_back(std::thread(std::move(update_task)));
+
+    // 开启处理接收到的消息
+    std::function<void()> process_recv_msg_task([this]{ this->recv(); });
+    threads_.push_back(std::thread(std::move(process_recv_msg_task)));
+    // std::function<void()> process_recv_task = std::bind(&connection_manager::recv, this);
+    // threads_.push_back(std::thread(process_recv_task));
+}
 
+void connection_manager::stopWorkers() {
+    stopped_.store(true);
+    // 唤醒阻塞中的 run/recv/update 线程
+    if (wakeup_fd_ >= 0) {
+        uint64_t one = 1;
+        ::write(wakeup_fd_, &one, sizeof(one));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        cv_.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(update_mtx_);
+        update_wake_ = true;
+        update_cv_.notify_all();
+    }
     for (auto iter = threads_.begin(); iter != threads_.end(); ++iter) {
         if (iter->joinable())
             iter->join();
     }
-    std::cout << "kcp stopped." << std::endl;
+}
+
+void connection_manager::handOff() {
+    int sock = acceptHandOff(hot_restart_fd_);
+    if (sock < 0)
+        return;
+    if (draining_.exchange(true)) {
+        ::close(sock);
+        return;
+    }
+    std::cout << "hot restart: hand off to new process" << std::endl;
+    // 先停掉 recv/update 线程，连接状态不再变化；队列中还没处理的包由 kcp 重传补回
+    stopWorkers();
+    std::vector<std::shared_ptr<connection>> conns = connection_->snapshot();
+    // 新进程恢复完连接并确认后才算交接成功，它在收到提交前不会收包
+    if (!sendHandOff(sock, sockfd_, snapshotState(conns))) {
+        ::close(sock);
+        // 新进程没有确认就不会接管 socket，本进程恢复收发继续服务，不通知客户端断开
+        std::cerr << "hot restart: hand off failed, keep serving" << std::endl;
+        conns.clear();
+        uint64_t count;
+        ::read(wakeup_fd_, &count, sizeof(count));
+        threads_.clear();
+        stopped_.store(false);
+        draining_.store(false);
+        startWorkers();
+        return;
+    }
+    for (auto& conn : conns) {
+        conn->detach();
+    }
+    std::cout << "hot restart: handed off " << conns.size() << " connections" << std::endl;
+    conns.clear();
+    // 连接已 detach，析构时不会通知客户端
+    connection_->stop();
+    commitHandOff(sock);
+    ::close(sock);
+    // 新进程持有同一个 socket，这里只关闭本进程的引用；路径由新进程收到提交后重新监听，不能删除
+    ::close(sockfd_);
+    sockfd_ = 0;
+    ::close(hot_restart_fd_);
+    hot_restart_fd_ = -1;
+}
+
+bool connection_manager::takeOver() {
+    int fd = recvHandOff(hot_restart_path_, restore_state_, hot_restart_peer_);
+    if (fd < 0)
+        return false;
+    std::cout << "hot restart: took over socket from old process" << std::endl;
+    sockfd_ = fd;
+    initEpoll();
+    return sockfd_ > 0;
+}
+
+void connection_manager::listenHotRestart() {
+    hot_restart_fd_ = listenHandOff(hot_restart_path_);
+    if (hot_restart_fd_ < 0)
+        return;
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = hot_restart_fd_;
+    if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, hot_restart_fd_, &event) == -1) {
+        std::cerr << "add hot restart socket to epoll failed with errno " << errno << " " << strerror(errno) << std::endl;
+    }
+}
+
+std::string connection_manager::snapshotState(const std::vector<std::shared_ptr<connection>>& conns) const {
+    // key[0] key[1] | 连接数 | { conv | addrKey | 会话随机数 | kcp 状态长度 | kcp 状态 } ...
+    std::string state;
+    char num[4];
+    auto put32 = [&](uint32_t value) {
+        encode32u(num, value);
+        state.append(num, sizeof(num));
+    };
+    uint64_t key[2];
+    cookie_.exportKey(key);
+    for (uint64_t k : key) {
+        put32((uint32_t)k);
+        put32((uint32_t)(k >> 32));
+    }
+    put32(conns.size());
+    std::string kcp_state;
+    for (auto& conn : conns) {
+        conn->snapshotKcp(kcp_state);
+        uint64_t addr_key = conn->getAddrKey();
+        put32(conn->getConv());
+        put32((uint32_t)addr_key);
+        put32((uint32_t)(addr_key >> 32));
+        put32((uint32_t)conn->getSessionNonce());
+        put32((uint32_t)(conn->getSessionNonce() >> 32));
+        put32(kcp_state.size());
+        state.append(kcp_state);
+    }
+    return state;
+}
+
+void connection_manager::restoreState() {
+    if (restore_state_.empty())
+        return;
+    const char* p = restore_state_.c_str();
+    const char* end = p + restore_state_.size();
+    auto get32 = [&](uint32_t& value) {
+        if (end - p < 4)
+            return false;
+        value = decode32u(p);
+        p += 4;
+        return true;
+    };
+    uint32_t words[4], count = 0;
+    for (uint32_t& word : words) {
+        if (!get32(word))
+            return;
+    }
+    uint64_t key[2] = {words[0] | ((uint64_t)words[1] << 32), words[2] | ((uint64_t)words[3] << 32)};
+    cookie_.importKey(key);
+
+    size_t restored = 0;
+    if (get32(count)) {
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t conv, key_lo, key_hi, nonce_lo, nonce_hi, len;
+            if (!get32(conv) || !get32(key_lo) || !get32(key_hi) || !get32(nonce_lo) || !get32(nonce_hi) || !get32(len) || (uint32_t)(end - p) < len)
+                break;
+            struct sockaddr_in addr = keyAddr(key_lo | ((uint64_t)key_hi << 32));
+            uint64_t nonce = nonce_lo | ((uint64_t)nonce_hi << 32);
+            if (connection_->restoreConnection(shared_from_this(), conv, &addr, nonce, std::string(p, len), getCurClock()))
+                ++restored;
+            p += len;
+        }
+    }
+    restore_state_.clear();
+    std::cout << "hot restart: restored " << restored << " connections" << std::endl;
+    wakeUpdate();
 }
 
 // timeout to disconnect client.
 void connection_manager::forceDisconnect(const uint32_t& conv) {
     std::cout << "force disconnect: " << conv << std::endl;
+    clock_service::tick();
 
     if (!connection_->findByConv(conv))
         return;
@@ -133,20 +340,74 @@ void connection_manager::forceDisconnect(const uint32_t& conv) {
    connection_->removeConnection(conv);
 }
 
+int connection_manager::setUpdateInterval(const uint32_t& conv, int interval_ms) {
+    // 应用线程调用，缓存时钟可能很旧
+    clock_service::tick();
+    std::shared_ptr<KCP::connection> conn = connection_->findByConv(conv);
+    if (!conn)
+        return KCP_ERR_NOT_EXIST_CONNECTION;
+
+    conn->setUpdateInterval(interval_ms);
+    connection_->schedule(conn, getCurClock());
+    wakeUpdate();
+    return 0;
+}
+
+void connection_manager::setHibernateAfter(uint32_t hibernate_after) {
+    connection_->setHibernateAfter(hibernate_after);
+}
+
 void connection_manager::setCallback(const std::function<event_callback_t>& func) {
     event_callback = func;
 }
 
+void connection_manager::setRecvViewCallback(const std::function<recv_view_callback_t>& func) {
+    recv_view_callback_ = func;
+}
+
 // send by kcp
 int connection_manager::send(const uint32_t& conv, std::shared_ptr<std::string> msg) {
     std::shared_ptr<KCP::connection> conn =connection_->findByConv(conv);
     if (!conn)
         return KCP_ERR_NOT_EXIST_CONNECTION;
     
-   conn->send(*msg);
+   conn->send(msg);
+   afterSend(conn);
    return 0;
 }
 
+int connection_manager::sendv(const uint32_t& conv, const struct iovec* iov, int iovcnt) {
+    std::shared_ptr<KCP::connection> conn = connection_->findByConv(conv);
+    if (!conn)
+        return KCP_ERR_NOT_EXIST_CONNECTION;
+
+    int ret = conn->sendv(iov, iovcnt);
+    afterSend(conn);
+    return ret < 0 ? KCP_ERR_SEND_FAILED : 0;
+}
+
+void connection_manager::afterSend(const std::shared_ptr<connection>& conn) {
+   // connection 的 send 在 prepareSend 中已经 tick 过，缓存时钟是新的
+   connection_->schedule(conn, getCurClock());
+   if (!low_latency_send_) {
+       wakeUpdate();
+       return;
+   }
+   if (s_in_recv_batch) {
+       if (conn->markFlush())
+           pending_flush_.push_back(conn);
+       wakeUpdate();
+       return;
+   }
+   // recv 线程之外的 send 交给 update 线程，下一轮循环统一 flush
+   {
+       std::lock_guard<std::mutex> lock(async_flush_mtx_);
+       if (conn->markFlush())
+           async_flush_.push_back(conn);
+   }
+   wakeUpdate(true);
+}
+
 // send by udp
 void connection_manager::sendByUdp(const char* buf, int len, struct sockaddr_in& addr) {
     int ret = ::sendto(sockfd_, buf, len, 0, (struct sockaddr*)&addr, sizeof(addr));
@@ -161,24 +422,39 @@ void connection_manager::callCallBack(const uint32_t conv, eEventType event_type
     event_callback(conv, event_type, msg);
 }
 
+void connection_manager::callRecvView(const uint32_t conv, std::shared_ptr<const std::string_view> msg) {
+    recv_view_callback_(conv, msg);
+}
+
 // 单独做一个线程，与::recv分开
 void connection_manager::recv() {
     std::cout << "thread_recv start: " << std::this_thread::get_id() << std::endl;
 
-    std::pair<std::string, struct sockaddr_in> recv_msg;
+    std::queue<std::pair<std::string, struct sockaddr_in>> batch;
     while (!stopped_) {
         {
+            // 没有消息时一直挂起，整批取走后释放锁
             std::unique_lock<std::mutex> recv_lock(mtx_);
-            cv_.wait_until(recv_lock, std::chrono::system_clock::now() + std::chrono::milliseconds(1));
+            cv_.wait(recv_lock, [this]{ return stopped_ || !recv_que_.empty(); });
+            batch.swap(recv_que_);
         }
-        while (!recv_que_.empty()) {
-            recv_msg = recv_que_.front();
-            recv_que_.pop();
-            if (0 == isRequireConnect(recv_msg.first.c_str(), recv_msg.first.length()))
-                processConnection(&(recv_msg.second));
+        if (stopped_) break;
+        // update 线程可能处于挂起状态，每批消息刷新一次时钟
+        clock_service::tick();
+        s_in_recv_batch = true;
+        while (!batch.empty()) {
+            auto& recv_msg = batch.front();
+            eCtrlType ctrl_type = getCtrlType(recv_msg.first.c_str(), recv_msg.first.length());
+            if (ctrl_type != eCtrlNone)
+                processCtrlMsg(ctrl_type, recv_msg.first, &(recv_msg.second));
             else 
-                processKcpMsg(recv_msg.first); // TODO: working thread pool to handle kcp msg.
+                processKcpMsg(recv_msg.first, &(recv_msg.second)); // TODO: working thread pool to handle kcp msg.
+            batch.pop();
         }
+        s_in_recv_batch = false;
+        flushPending();
+        // 整批处理完后再唤醒 update 线程发送 ack 和回包
+        wakeUpdate();
     }
     
     std::cout << "thread_recv exit.";
@@ -186,30 +462,210 @@ void connection_manager::recv() {
 
 void connection_manager::update() {
     std::cout << "thread_update start: " << std::this_thread::get_id() << std::endl;
+    std::vector<std::shared_ptr<connection>> closed;
     while (!stopped_) {
-        auto current = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-        cur_clock_.store(current);
-        connection_->update(current);
-        std::this_thread::sleep_for(std::chrono::milliseconds(KCP_UPDATE_INTERVAL));
+        uint32_t current = clock_service::tick();
+        flushAsync();
+        int wait_ms = connection_->update(current, closed);
+        if (!closed.empty()) {
+            closeConnections(std::move(closed));
+            closed.clear();
+        }
+
+        std::unique_lock<std::mutex> lock(update_mtx_);
+        if (update_wake_) {
+            update_wake_ = false;
+            continue;
+        }
+        if (wait_ms < 0) {
+            // 没有任何定时任务，挂起直到有新数据或新连接
+            update_parked_ = true;
+            update_cv_.wait(lock, [this]{ return update_wake_; });
+            update_parked_ = false;
+        } else {
+            next_update_clock_ = current + wait_ms;
+            update_cv_.wait_for(lock, std::chrono::milliseconds(wait_ms), [this]{ return update_wake_; });
+        }
+        update_wake_ = false;
     }
     
     std::cout << "thread_update exit.";
 }
 
+
+void connection_manager::closeConnections(std::vector<std::shared_ptr<connection>> conns) {
+    for (auto& conn : conns) {
+        conn->detach();
+        disconnects_.add(sockfd_, conn->getConv(), conn->getAddrKey());
+    }
+    disconnects_.flush(sockfd_);
+    // 通知已经发出，最后一个引用在这里释放，kcp 和 connection 对象归还 slab
+    conns.clear();
+}
+
+void connection_manager::flushPending() {
+    if (pending_flush_.empty())
+        return;
+    // 批处理期间时钟可能已经走了一段，flush 前刷新
+    clock_service::tick();
+    for (auto& conn : pending_flush_) {
+        conn->flush();
+    }
+    pending_flush_.clear();
+}
+
+void connection_manager::flushAsync() {
+    std::vector<std::shared_ptr<connection>> conns;
+    {
+        std::lock_guard<std::mutex> lock(async_flush_mtx_);
+        conns.swap(async_flush_);
+    }
+    for (auto& conn : conns) {
+        conn->flush();
+    }
+}
+
+void connection_manager::wakeUpdate(bool immediate) {
+    std::lock_guard<std::mutex> lock(update_mtx_);
+    update_wake_ = true;
+    // update 线程会在一个 kcp 间隔内醒来，醒来时会看到标记，不需要额外 notify
+    if (immediate || update_parked_ || (int32_t)(next_update_clock_ - (getCurClock() + KCP_UPDATE_INTERVAL)) > 0)
+        update_cv_.notify_one();
+}
             
+void connection_manager::processCtrlMsg(eCtrlType type, const std::string& recv_msg, struct sockaddr_in* addr) {
+    // 排空中不再建立新连接，客户端握手超时后会连到其它实例
+    if (draining_ && (type == eCtrlConnect || type == eCtrlCookieEcho || type == eCtrlResume))
+        return;
+    switch (type) {
+        case eCtrlConnect: {
+            if (!admission_.allowChallenge(getCurClock()))
+                break;
+            char challenge[KCP_CTRL_MAX_SIZE];
+            char cookie[KCP_COOKIE_SIZE];
+            cookie_.generate(*addr, getCurClock(), cookie);
+            int len = encodeCtrlPacket(challenge, eCtrlChallenge, cookie, sizeof(cookie));
+            sendByUdp(challenge, len, *addr);
+            break;
+        }
+        case eCtrlCookieEcho: {
+            if (!cookie_.verify(*addr, getCurClock(), recv_msg.c_str() + KCP_CTRL_HEAD_SIZE, recv_msg.length() - KCP_CTRL_HEAD_SIZE)) {
+                admission_.onCookieInvalid();
+                break;
+            }
+            // 同一地址的重复请求（accept 丢失后客户端重试）直接重发原来的 conv
+            if (auto conn = connection_->findByAddr(*addr)) {
+                admission_.onDeduplicated();
+                sendAccept(conn, addr);
+                break;
+            }
+            if (admission_.allowAccept(*addr, getCurClock()) != admission_control::eAdmitted)
+                break;
+            processConnection(addr);
+            break;
+        }
+        case eCtrlMigrate:
+            processMigrate(recv_msg, addr);
+            break;
+        case eCtrlResume:
+            processResume(recv_msg, addr);
+            break;
+        default:
+            // 其它控制包只由服务端发出
+            break;
+    }
+}
+
 void connection_manager::processConnection(struct sockaddr_in* addr) {
-    uint32_t conv = connection_->getNewConv();
-    std::string send_back_msg = GenerateSendBackConvMsg(conv);
-    int ret = ::sendto(sockfd_, send_back_msg.c_str(), send_back_msg.length(), 0, (struct sockaddr*)addr, sizeof(*addr));
-    if (ret < 0) {
-        std::cout << "send failed with errno " << errno << " " << strerror(errno) << std::endl;
+    auto conn = connection_->addConnection(shared_from_this(), addr, getCurClock());
+    if (!conn)
+        return;
+    std::cout << "accept conv: " << conn->getConv() << " addr: " << inet_ntoa(addr->sin_addr)<< ":" << ntohs(addr->sin_port) << std::endl;
+    sendAccept(conn, addr);
+}
+
+void connection_manager::sendAccept(const std::shared_ptr<connection>& conn, struct sockaddr_in* addr) {
+    char payload[4 + KCP_MIGRATE_TOKEN_SIZE];
+    uint64_t token = cookie_.migrateToken(conn->getConv(), conn->getSessionNonce());
+    encode32u(payload, conn->getConv());
+    encode32u(payload + 4, (uint32_t)token);
+    encode32u(payload + 8, (uint32_t)(token >> 32));
+    char accept_msg[KCP_CTRL_MAX_SIZE];
+    int len = encodeCtrlPacket(accept_msg, eCtrlAccept, payload, sizeof(payload));
+    sendByUdp(accept_msg, len, *addr);
+}
+
+void connection_manager::processMigrate(const std::string& recv_msg, struct sockaddr_in* addr) {
+    if (recv_msg.length() < (size_t)KCP_CTRL_HEAD_SIZE + 4 + KCP_MIGRATE_TOKEN_SIZE)
+        return;
+    const char* payload = recv_msg.c_str() + KCP_CTRL_HEAD_SIZE;
+    uint32_t conv = decode32u(payload);
+    auto conn = connection_->findByConv(conv);
+    if (!conn)
+        return;
+    // 令牌和当前会话的随机数绑定，同一 conv 上更早会话的令牌无效
+    if (!verifyMigrateToken(conv, conn->getSessionNonce(), payload + 4)) {
+        std::cout << "invalid migrate token for conv: " << conv << std::endl;
+        return;
+    }
+    if (conn->getAddrKey() == addrKey(*addr))
+        return;
+    connection_->migrate(conn, *addr);
+    connection_->touch(conn, getCurClock());
+    // 新地址马上收到积压的数据和 ack
+    connection_->schedule(conn, getCurClock());
+    std::cout << "conv: " << conv << " migrate to: " << inet_ntoa(addr->sin_addr)<< ":" << ntohs(addr->sin_port) << std::endl;
+}
+
+void connection_manager::processResume(const std::string& recv_msg, struct sockaddr_in* addr) {
+    if (recv_msg.length() < (size_t)KCP_CTRL_HEAD_SIZE + KCP_RESUME_SIZE)
+        return;
+    const char* payload = recv_msg.c_str() + KCP_CTRL_HEAD_SIZE;
+    uint32_t conv = decode32u(payload);
+    if (connection_->findByConv(conv)) {
+        // 服务端会话还在，kcp 状态完整保留，只需切换地址，票据在迁移中校验
+        processMigrate(recv_msg, addr);
+        return;
+    }
+
+    uint64_t nonce = 0;
+    if (!connection_->resumeNonce(conv, getCurClock(), nonce)) {
+        // 会话已过期或槽位已被复用，通知客户端重新握手；无法校验票据，和 cookie 共用速率限制防止反射
+        if (admission_.allowChallenge(getCurClock())) {
+            char disconnect_msg[KCP_CTRL_MAX_SIZE];
+            int len = encodeCtrlPacket(disconnect_msg, eCtrlDisconnect, conv);
+            sendByUdp(disconnect_msg, len, *addr);
+        }
+        return;
+    }
+    if (!verifyMigrateToken(conv, nonce, payload + 4)) {
+        std::cout << "invalid resume ticket for conv: " << conv << std::endl;
+        return;
+    }
+
+    uint32_t client_snd_una = decode32u(payload + 4 + KCP_MIGRATE_TOKEN_SIZE);
+    uint32_t client_rcv_nxt = decode32u(payload + 8 + KCP_MIGRATE_TOKEN_SIZE);
+    std::shared_ptr<connection> conn;
+    if (admission_.allowAccept(*addr, getCurClock()) == admission_control::eAdmitted)
+        conn = connection_->resumeConnection(shared_from_this(), conv, addr, getCurClock(), client_rcv_nxt, client_snd_una);
+    if (!conn) {
+        // 会话已过期或槽位已被复用，通知客户端重新握手
+        char disconnect_msg[KCP_CTRL_MAX_SIZE];
+        int len = encodeCtrlPacket(disconnect_msg, eCtrlDisconnect, conv);
+        sendByUdp(disconnect_msg, len, *addr);
         return;
     }
-    std::cout << "send: " << send_back_msg << " addr: " << inet_ntoa(addr->sin_addr)<< ":" << ntohs(addr->sin_port) << std::endl;
-    connection_->addConnection(shared_from_this(), conv, addr);
+    std::cout << "conv: " << conv << " resumed from: " << inet_ntoa(addr->sin_addr)<< ":" << ntohs(addr->sin_port) << std::endl;
+}
+
+bool connection_manager::verifyMigrateToken(uint32_t conv, uint64_t nonce, const char* token) const {
+    uint64_t expected = cookie_.migrateToken(conv, nonce);
+    return decode32u(token) == (uint32_t)expected && decode32u(token + 4) == (uint32_t)(expected >> 32);
 }
 
-void connection_manager::processKcpMsg(const std::string& recv_msg) {
+void connection_manager::processKcpMsg(const std::string& recv_msg, struct sockaddr_in* addr) {
+    if (recv_msg.length() < IKCP_OVERHEAD)
+        return;
     std::cout << "recv msg len: " << recv_msg.length() << " " << recv_msg.c_str() + IKCP_OVERHEAD << std::endl;
     // ikcp_send_msg_check(recv_msg.c_str(), recv_msg.length());
     uint32_t conv = ikcp_getconv(recv_msg.c_str());
@@ -219,8 +675,28 @@ void connection_manager::processKcpMsg(const std::string& recv_msg) {
         std::cout <<  "connection not exist with conv: " << conv << std::endl;
         return;
     }
+    if (conn->getAddrKey() != addrKey(*addr)) {
+        // 地址变了（NAT 重绑定/漫游），不能只凭 conv 信任，要求客户端出示迁移令牌
+        // 回包很小，和 cookie 共用全局速率限制，防止被用来反射
+        if (admission_.allowChallenge(getCurClock())) {
+            char request[KCP_CTRL_MAX_SIZE];
+            int len = encodeCtrlPacket(request, eCtrlMigrateRequest, conv);
+            sendByUdp(request, len, *addr);
+        }
+        return;
+    }
 
-    conn->input(recv_msg);
+    connection_->touch(conn, getCurClock());
+    if (isKcpProbe(recv_msg.c_str(), recv_msg.length())) {
+        // 保活探测只刷新超时时间，不算作流量，不打断退避和休眠
+        if (conn->keepalive(recv_msg) && conn->markFlush())
+            pending_flush_.push_back(conn);
+        return;
+    }
+    connection_->schedule(conn, getCurClock());
+    // 立即回 ack，对端 rtt 估计不再多出一个 update 间隔
+    if (conn->input(recv_msg) && conn->markFlush())
+        pending_flush_.push_back(conn);
 }
 
 void connection_manager::initServer(const int& port) {
@@ -277,6 +753,10 @@ void connection_manager::initServer(const int& port) {
             return;
         }
     }
+    initEpoll();
+}
+
+void connection_manager::initEpoll() {
     // set epoll
     {
         epoll_fd_ = epoll_create(1);
@@ -293,6 +773,25 @@ void connection_manager::initServer(const int& port) {
             std::cerr << "add epoll failed with errno " << errno << " " << strerror(errno) << std::endl;
             ::close(sockfd_);
             sockfd_ = 0;
+            return;
+        }
+    }
+    // stop 唤醒 run 用的 eventfd
+    {
+        wakeup_fd_ = ::eventfd(0, EFD_NONBLOCK);
+        if (wakeup_fd_ == -1) {
+            std::cerr << "create eventfd failed with errno " << errno << " " << strerror(errno) << std::endl;
+            ::close(sockfd_);
+            sockfd_ = 0;
+            return;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = wakeup_fd_;
+        if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wakeup_fd_, &event) == -1) {
+            std::cerr << "add eventfd to epoll failed with errno " << errno << " " << strerror(errno) << std::endl;
+            ::close(sockfd_);
+            sockfd_ = 0;
         }
     }
 }
@@ -0,0 +1,41 @@
+#include "../include/disconnect_batch.hpp"
+
+#include <iostream>
+#include <cstring>
+
+namespace KCP {
+
+disconnect_batch::disconnect_batch(size_t capacity) 
+    : buffers_(capacity * KCP_CTRL_MAX_SIZE), addrs_(capacity), iovs_(capacity), msgs_(capacity) {
+    for (size_t i = 0; i < capacity; ++i) {
+        iovs_[i].iov_base = &buffers_[i * KCP_CTRL_MAX_SIZE];
+        msgs_[i].msg_hdr.msg_iov = &iovs_[i];
+        msgs_[i].msg_hdr.msg_iovlen = 1;
+        msgs_[i].msg_hdr.msg_name = &addrs_[i];
+        msgs_[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+}
+
+void disconnect_batch::add(int sockfd, uint32_t conv, uint64_t addr_key) {
+    iovs_[count_].iov_len = encodeCtrlPacket(&buffers_[count_ * KCP_CTRL_MAX_SIZE], eCtrlDisconnect, conv);
+    addrs_[count_] = keyAddr(addr_key);
+    if (++count_ == msgs_.size())
+        flush(sockfd);
+}
+
+void disconnect_batch::flush(int sockfd) {
+    size_t sent = 0;
+    while (sent < count_) {
+        int ret = ::sendmmsg(sockfd, &msgs_[sent], count_ - sent, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            std::cout << "send disconnect batch failed with errno " << errno << " " << strerror(errno) << std::endl;
+            break;
+        }
+        sent += ret;
+    }
+    count_ = 0;
+}
+
+};
@@ -0,0 +1,96 @@
+#include "../include/handshake_cookie.hpp"
+
+#include <random>
+#include <cstring>
+
+namespace KCP {
+
+namespace {
+
+inline uint64_t rotl(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+inline void sipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3) {
+    v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+    v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+    v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+    v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+}
+
+// SipHash-2-4，输入很短，按 8 字节小端分块
+uint64_t sipHash24(const uint64_t key[2], const unsigned char* in, size_t len) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+
+    const size_t tail = len & 7;
+    const unsigned char* end = in + len - tail;
+    for (; in != end; in += 8) {
+        uint64_t m = 0;
+        for (int i = 0; i < 8; ++i)
+            m |= (uint64_t)in[i] << (8 * i);
+        v3 ^= m;
+        sipRound(v0, v1, v2, v3);
+        sipRound(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    uint64_t b = (uint64_t)len << 56;
+    for (size_t i = 0; i < tail; ++i)
+        b |= (uint64_t)in[i] << (8 * i);
+    v3 ^= b;
+    sipRound(v0, v1, v2, v3);
+    sipRound(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; ++i)
+        sipRound(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+};
+
+handshake_cookie::handshake_cookie() {
+    std::random_device rd;
+    key_[0] = ((uint64_t)rd() << 32) | rd();
+    key_[1] = ((uint64_t)rd() << 32) | rd();
+}
+
+void handshake_cookie::generate(const struct sockaddr_in& addr, uint32_t clock, char* cookie) const {
+    uint64_t m = mac(addr, clock);
+    encode32u(cookie, clock);
+    encode32u(cookie + 4, (uint32_t)m);
+    encode32u(cookie + 8, (uint32_t)(m >> 32));
+}
+
+bool handshake_cookie::verify(const struct sockaddr_in& addr, uint32_t clock, const char* cookie, int len) const {
+    if (len < KCP_COOKIE_SIZE)
+        return false;
+    uint32_t issue_clock = decode32u(cookie);
+    int32_t age = (int32_t)(clock - issue_clock);
+    if (age < 0 || age > (int32_t)KCP_COOKIE_LIFETIME)
+        return false;
+    uint64_t m = mac(addr, issue_clock);
+    return decode32u(cookie + 4) == (uint32_t)m && decode32u(cookie + 8) == (uint32_t)(m >> 32);
+}
+
+uint64_t handshake_cookie::migrateToken(uint32_t conv, uint64_t nonce) const {
+    // 加上前缀和 cookie 的输入区分开
+    unsigned char in[16] = {'m', 'i', 'g', 'r'};
+    encode32u((char*)in + 4, conv);
+    encode32u((char*)in + 8, (uint32_t)nonce);
+    encode32u((char*)in + 12, (uint32_t)(nonce >> 32));
+    return sipHash24(key_, in, sizeof(in));
+}
+
+uint64_t handshake_cookie::mac(const struct sockaddr_in& addr, uint32_t issue_clock) const {
+    // ip 和端口保持网络字节序原样参与计算
+    unsigned char in[10];
+    ::memcpy(in, &addr.sin_addr.s_addr, 4);
+    ::memcpy(in + 4, &addr.sin_port, 2);
+    encode32u((char*)in + 6, issue_clock);
+    return sipHash24(key_, in, sizeof(in));
+}
+
+};
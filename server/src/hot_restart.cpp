@@ -0,0 +1,233 @@
+#include "../include/hot_restart.hpp"
+#include "../include/util.hpp"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <iostream>
+#include <cstring>
+
+namespace KCP {
+
+namespace {
+
+bool makeUnixAddr(const std::string& path, struct sockaddr_un& addr) {
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "hot restart path too long: " << path << std::endl;
+        return false;
+    }
+    ::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    ::memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+bool writeAll(int sock, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(sock, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool readAll(int sock, char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::read(sock, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// 交接期间的读写都不能无限阻塞，对端卡住时超时失败
+bool setTimeout(int sock) {
+    struct timeval tv{};
+    tv.tv_sec = KCP_HOT_RESTART_TIMEOUT / 1000;
+    tv.tv_usec = (KCP_HOT_RESTART_TIMEOUT % 1000) * 1000;
+    return ::setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == 0
+        && ::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0;
+}
+
+bool samePeerUser(int sock) {
+    struct ucred cred{};
+    socklen_t len = sizeof(cred);
+    if (::getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        std::cerr << "get hot restart peer credentials failed with errno " << errno << " " << strerror(errno) << std::endl;
+        return false;
+    }
+    if (cred.uid != ::geteuid()) {
+        std::cerr << "hot restart peer pid " << cred.pid << " uid " << cred.uid << " rejected" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool sendTag(int sock, char tag) {
+    return writeAll(sock, &tag, sizeof(tag));
+}
+
+bool recvTag(int sock, char expect) {
+    char tag = 0;
+    return readAll(sock, &tag, sizeof(tag)) && tag == expect;
+}
+
+}
+
+int listenHandOff(const std::string& path) {
+    struct sockaddr_un addr;
+    if (!makeUnixAddr(path, addr))
+        return -1;
+    int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        std::cerr << "create hot restart socket failed with errno " << errno << " " << strerror(errno) << std::endl;
+        return -1;
+    }
+    // 上一个进程留下的路径已经交接完毕或失效
+    ::unlink(path.c_str());
+    if (::bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 || ::listen(sock, 1) == -1) {
+        std::cerr << "listen hot restart socket failed with errno " << errno << " " << strerror(errno) << std::endl;
+        ::close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+int acceptHandOff(int listen_fd) {
+    int sock = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (sock < 0)
+        return -1;
+    if (!samePeerUser(sock)) {
+        ::close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+bool sendHandOff(int sock, int udp_fd, const std::string& state) {
+    // accept 出来的 fd 可能继承了非阻塞标志，交接数据按阻塞方式写完，由超时兜底
+    int flags = ::fcntl(sock, F_GETFL, 0);
+    if (flags != -1)
+        ::fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+    if (!setTimeout(sock)) {
+        std::cerr << "set hot restart timeout failed with errno " << errno << " " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    char tag = 'K';
+    struct iovec iov{&tag, sizeof(tag)};
+    char control[CMSG_SPACE(sizeof(int))]{};
+    struct msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    ::memcpy(CMSG_DATA(cmsg), &udp_fd, sizeof(int));
+    if (::sendmsg(sock, &msg, 0) != (ssize_t)sizeof(tag)) {
+        std::cerr << "send hot restart socket failed with errno " << errno << " " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    char len_buf[4];
+    encode32u(len_buf, (uint32_t)state.size());
+    if (!writeAll(sock, len_buf, sizeof(len_buf)) || !writeAll(sock, state.data(), state.size())) {
+        std::cerr << "send hot restart state failed with errno " << errno << " " << strerror(errno) << std::endl;
+        return false;
+    }
+    // 字节写进缓冲区不代表新进程已接管，等它恢复完连接后的确认
+    if (!recvTag(sock, 'A')) {
+        std::cerr << "wait hot restart ack failed with errno " << errno << " " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool commitHandOff(int sock) {
+    if (!sendTag(sock, 'C')) {
+        std::cerr << "send hot restart commit failed with errno " << errno << " " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int recvHandOff(const std::string& path, std::string& state, int& sock) {
+    sock = -1;
+    struct sockaddr_un addr;
+    if (!makeUnixAddr(path, addr))
+        return -1;
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (::connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        // 没有旧进程在运行，正常启动
+        ::close(fd);
+        return -1;
+    }
+    if (!samePeerUser(fd) || !setTimeout(fd)) {
+        ::close(fd);
+        return -1;
+    }
+
+    char tag = 0;
+    struct iovec iov{&tag, sizeof(tag)};
+    char control[CMSG_SPACE(sizeof(int))]{};
+    struct msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int udp_fd = -1;
+    if (::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) == (ssize_t)sizeof(tag)) {
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            ::memcpy(&udp_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (udp_fd < 0) {
+        std::cerr << "recv hot restart socket failed with errno " << errno << " " << strerror(errno) << std::endl;
+        ::close(fd);
+        return -1;
+    }
+
+    char len_buf[4];
+    bool ok = readAll(fd, len_buf, sizeof(len_buf));
+    if (ok) {
+        state.resize(decode32u(len_buf));
+        ok = readAll(fd, &state[0], state.size());
+    }
+    if (!ok) {
+        // 状态不完整时放弃接管，旧进程等不到确认后继续服务，端口仍由它持有
+        std::cerr << "recv hot restart state failed" << std::endl;
+        ::close(fd);
+        ::close(udp_fd);
+        state.clear();
+        return -1;
+    }
+    sock = fd;
+    return udp_fd;
+}
+
+bool confirmHandOff(int sock) {
+    // 旧进程超时放弃后不会再提交，这时即使确认已写出也收不到提交
+    const bool committed = sendTag(sock, 'A') && recvTag(sock, 'C');
+    if (!committed)
+        std::cerr << "hot restart: no commit from old process, errno " << errno << " " << strerror(errno) << std::endl;
+    ::close(sock);
+    return committed;
+}
+
+};
@@ -45,6 +45,19 @@ const IUINT32 IKCP_PROBE_INIT = 7000;		// 7 secs to probe window size
 const IUINT32 IKCP_PROBE_LIMIT = 120000;	// up to 120 secs to probe window
 const IUINT32 IKCP_FASTACK_LIMIT = 5;		// max times to trigger fastack
 
+// flush scratch buffer shared by every kcp flushed on the same thread, the
+// output callback consumes each packet before returning so it can be reused.
+// only a kcp whose (mtu + overhead) * 3 does not fit keeps a private buffer
+#define IKCP_FLUSH_BUFFER 8192
+
+#if defined(_MSC_VER)
+#define IKCP_THREAD_LOCAL __declspec(thread)
+#else
+#define IKCP_THREAD_LOCAL __thread
+#endif
+
+static IKCP_THREAD_LOCAL char ikcp_flush_buffer[IKCP_FLUSH_BUFFER];
+
 
 //---------------------------------------------------------------------
 // encode / decode
@@ -169,16 +182,289 @@ void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*))
 	ikcp_free_hook = new_free;
 }
 
+// allocate on behalf of a kcp, through its own allocator when it has one
+static void* ikcp_kmalloc(const ikcpcb *kcp, size_t size) {
+	if (kcp->allocator) 
+		return kcp->allocator->alloc(size, kcp->allocator->ctx);
+	return ikcp_malloc(size);
+}
+
+// size must be the one passed to ikcp_kmalloc
+static void ikcp_kfree(const ikcpcb *kcp, void *ptr, size_t size) {
+	if (kcp->allocator) {
+		kcp->allocator->release(ptr, size, kcp->allocator->ctx);
+	}	else {
+		ikcp_free(ptr);
+	}
+}
+
 // allocate a new kcp segment
 static IKCPSEG* ikcp_segment_new(ikcpcb *kcp, int size)
 {
-	return (IKCPSEG*)ikcp_malloc(sizeof(IKCPSEG) + size);
+	IKCPSEG *seg = (IKCPSEG*)ikcp_kmalloc(kcp, sizeof(IKCPSEG) + size);
+	if (seg != NULL) {
+		iqueue_init(&seg->fast_node);
+		seg->ref = NULL;
+		seg->ext = NULL;
+	}
+	return seg;
+}
+
+//---------------------------------------------------------------------
+// zero-copy payload shared by the segments of one ikcp_send_ref
+//---------------------------------------------------------------------
+struct IKCPREF
+{
+	IUINT32 count;
+	void (*release)(void *opaque);
+	void *opaque;
+};
+
+static void ikcp_ref_put(ikcpcb *kcp, struct IKCPREF *ref)
+{
+	if (--ref->count == 0) {
+		ref->release(ref->opaque);
+		ikcp_kfree(kcp, ref, sizeof(struct IKCPREF));
+	}
+}
+
+static inline const char *ikcp_segment_data(const IKCPSEG *seg)
+{
+	return (seg->ref != NULL)? seg->ext : seg->data;
 }
 
 // delete a segment
 static void ikcp_segment_delete(ikcpcb *kcp, IKCPSEG *seg)
 {
-	ikcp_free(seg);
+	if (seg->ref != NULL) {
+		ikcp_ref_put(kcp, seg->ref);
+		ikcp_kfree(kcp, seg, sizeof(IKCPSEG));
+	}	else {
+		ikcp_kfree(kcp, seg, sizeof(IKCPSEG) + seg->len);
+	}
+}
+
+//---------------------------------------------------------------------
+// receive ring: O(1) duplicate check / insert, contiguous in-order scan
+//---------------------------------------------------------------------
+#define IKCP_RING_TEST(map, i)	((map)[(i) >> 5] & (1u << ((i) & 31)))
+#define IKCP_RING_SET(map, i)	((map)[(i) >> 5] |= (1u << ((i) & 31)))
+#define IKCP_RING_CLR(map, i)	((map)[(i) >> 5] &= ~(1u << ((i) & 31)))
+
+static void ikcp_rcv_ring_free(ikcpcb *kcp)
+{
+	ikcp_kfree(kcp, kcp->rcv_ring, sizeof(IKCPSEG*) * kcp->rcv_ring_size);
+	ikcp_kfree(kcp, kcp->rcv_ring_map, sizeof(IUINT32) * ((kcp->rcv_ring_size + 31) >> 5));
+	kcp->rcv_ring = NULL;
+	kcp->rcv_ring_map = NULL;
+}
+
+// ring capacity for a receive window: the next power of two, so that
+// sn & (size - 1) stays unique inside the window across the 2^32 wrap
+static IUINT32 ikcp_rcv_ring_capacity(IUINT32 wnd)
+{
+	IUINT32 size = 1;
+	while (size < wnd) size <<= 1;
+	return size;
+}
+
+// (re)allocate the ring for the current rcv_wnd, segments outside the
+// new window are dropped and will be retransmitted by the peer
+static int ikcp_rcv_ring_resize(ikcpcb *kcp)
+{
+	IUINT32 size = ikcp_rcv_ring_capacity(kcp->rcv_wnd);
+	IUINT32 words = (size + 31) >> 5, i;
+	IKCPSEG **ring = (IKCPSEG**)ikcp_kmalloc(kcp, sizeof(IKCPSEG*) * size);
+	IUINT32 *map = (IUINT32*)ikcp_kmalloc(kcp, sizeof(IUINT32) * words);
+	if (ring == NULL || map == NULL) {
+		if (ring) ikcp_kfree(kcp, ring, sizeof(IKCPSEG*) * size);
+		if (map) ikcp_kfree(kcp, map, sizeof(IUINT32) * words);
+		return -1;
+	}
+	memset(map, 0, sizeof(IUINT32) * words);
+	if (kcp->rcv_ring) {
+		for (i = 0; i < kcp->rcv_ring_size; i++) {
+			IKCPSEG *seg;
+			if (!IKCP_RING_TEST(kcp->rcv_ring_map, i)) continue;
+			seg = kcp->rcv_ring[i];
+			if (_itimediff(seg->sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0) {
+				ring[seg->sn & (size - 1)] = seg;
+				IKCP_RING_SET(map, seg->sn & (size - 1));
+			}	else {
+				ikcp_segment_delete(kcp, seg);
+				kcp->nrcv_buf--;
+			}
+		}
+		ikcp_rcv_ring_free(kcp);
+	}
+	kcp->rcv_ring = ring;
+	kcp->rcv_ring_map = map;
+	kcp->rcv_ring_size = size;
+	return 0;
+}
+
+// insert a segment whose sn is inside the receive window, 
+// returns -1 if it is a duplicate
+static int ikcp_rcv_ring_insert(ikcpcb *kcp, IKCPSEG *seg)
+{
+	IUINT32 index = seg->sn & (kcp->rcv_ring_size - 1);
+	if (IKCP_RING_TEST(kcp->rcv_ring_map, index)) {
+		IKCPSEG *old = kcp->rcv_ring[index];
+		if (old->sn == seg->sn)
+			return -1;
+		// stale slot from outside the window, never delivered
+		ikcp_segment_delete(kcp, old);
+		kcp->nrcv_buf--;
+	}
+	kcp->rcv_ring[index] = seg;
+	IKCP_RING_SET(kcp->rcv_ring_map, index);
+	kcp->nrcv_buf++;
+	return 0;
+}
+
+// move available data from rcv_ring -> rcv_queue
+static void ikcp_rcv_ring_deliver(ikcpcb *kcp)
+{
+	while (kcp->nrcv_buf > 0 && kcp->nrcv_que < kcp->rcv_wnd) {
+		IUINT32 index = kcp->rcv_nxt & (kcp->rcv_ring_size - 1);
+		IKCPSEG *seg;
+		if (!IKCP_RING_TEST(kcp->rcv_ring_map, index))
+			break;
+		seg = kcp->rcv_ring[index];
+		IKCP_RING_CLR(kcp->rcv_ring_map, index);
+		kcp->nrcv_buf--;
+		if (seg->sn != kcp->rcv_nxt) {
+			// stale slot, rcv_nxt itself has not arrived yet
+			ikcp_segment_delete(kcp, seg);
+			break;
+		}
+		iqueue_add_tail(&seg->node, &kcp->rcv_queue);
+		kcp->nrcv_que++;
+		kcp->rcv_nxt++;
+	}
+}
+
+//---------------------------------------------------------------------
+// retransmission heap: snd_buf ordered by resendts, earliest on top
+//---------------------------------------------------------------------
+static inline int ikcp_snd_heap_less(const IKCPSEG *a, const IKCPSEG *b)
+{
+	return _itimediff(a->resendts, b->resendts) < 0;
+}
+
+static inline void ikcp_snd_heap_set(ikcpcb *kcp, IUINT32 index, IKCPSEG *seg)
+{
+	kcp->snd_heap[index] = seg;
+	seg->heap_index = index;
+}
+
+static void ikcp_snd_heap_up(ikcpcb *kcp, IUINT32 index)
+{
+	IKCPSEG *seg = kcp->snd_heap[index];
+	while (index > 0) {
+		IUINT32 parent = (index - 1) >> 1;
+		if (!ikcp_snd_heap_less(seg, kcp->snd_heap[parent])) break;
+		ikcp_snd_heap_set(kcp, index, kcp->snd_heap[parent]);
+		index = parent;
+	}
+	ikcp_snd_heap_set(kcp, index, seg);
+}
+
+static void ikcp_snd_heap_down(ikcpcb *kcp, IUINT32 index)
+{
+	IKCPSEG *seg = kcp->snd_heap[index];
+	IUINT32 size = kcp->snd_heap_size;
+	while (1) {
+		IUINT32 child = index * 2 + 1;
+		if (child >= size) break;
+		if (child + 1 < size && 
+			ikcp_snd_heap_less(kcp->snd_heap[child + 1], kcp->snd_heap[child]))
+			child++;
+		if (!ikcp_snd_heap_less(kcp->snd_heap[child], seg)) break;
+		ikcp_snd_heap_set(kcp, index, kcp->snd_heap[child]);
+		index = child;
+	}
+	ikcp_snd_heap_set(kcp, index, seg);
+}
+
+static void ikcp_snd_heap_push(ikcpcb *kcp, IKCPSEG *seg)
+{
+	if (kcp->snd_heap_size >= kcp->snd_heap_block) {
+		IUINT32 newblock = (kcp->snd_heap_block > 0)? kcp->snd_heap_block * 2 : 32;
+		IKCPSEG **heap = (IKCPSEG**)ikcp_kmalloc(kcp, sizeof(IKCPSEG*) * newblock);
+		if (heap == NULL) {
+			assert(heap != NULL);
+			abort();
+		}
+		if (kcp->snd_heap != NULL) {
+			memcpy(heap, kcp->snd_heap, sizeof(IKCPSEG*) * kcp->snd_heap_size);
+			ikcp_kfree(kcp, kcp->snd_heap, sizeof(IKCPSEG*) * kcp->snd_heap_block);
+		}
+		kcp->snd_heap = heap;
+		kcp->snd_heap_block = newblock;
+	}
+	ikcp_snd_heap_set(kcp, kcp->snd_heap_size++, seg);
+	ikcp_snd_heap_up(kcp, seg->heap_index);
+}
+
+static void ikcp_snd_heap_remove(ikcpcb *kcp, IKCPSEG *seg)
+{
+	IUINT32 index = seg->heap_index;
+	IKCPSEG *last = kcp->snd_heap[--kcp->snd_heap_size];
+	if (last == seg) return;
+	ikcp_snd_heap_set(kcp, index, last);
+	ikcp_snd_heap_up(kcp, index);
+	ikcp_snd_heap_down(kcp, last->heap_index);
+}
+
+//---------------------------------------------------------------------
+// send ring: O(1) lookup of an in-flight segment by sn
+//---------------------------------------------------------------------
+static void ikcp_snd_ring_add(ikcpcb *kcp, IKCPSEG *seg)
+{
+	IUINT32 need = seg->sn - kcp->snd_una + 1;
+	if (need > kcp->snd_ring_size) {
+		IUINT32 size = (kcp->snd_ring_size > 0)? kcp->snd_ring_size : 32;
+		IKCPSEG **ring;
+		IUINT32 i;
+		while (size < need) size <<= 1;
+		ring = (IKCPSEG**)ikcp_kmalloc(kcp, sizeof(IKCPSEG*) * size);
+		if (ring == NULL) {
+			assert(ring != NULL);
+			abort();
+		}
+		memset(ring, 0, sizeof(IKCPSEG*) * size);
+		for (i = 0; i < kcp->snd_ring_size; i++) {
+			IKCPSEG *old = kcp->snd_ring[i];
+			if (old) ring[old->sn & (size - 1)] = old;
+		}
+		if (kcp->snd_ring) 
+			ikcp_kfree(kcp, kcp->snd_ring, sizeof(IKCPSEG*) * kcp->snd_ring_size);
+		kcp->snd_ring = ring;
+		kcp->snd_ring_size = size;
+	}
+	kcp->snd_ring[seg->sn & (kcp->snd_ring_size - 1)] = seg;
+}
+
+static IKCPSEG *ikcp_snd_ring_get(const ikcpcb *kcp, IUINT32 sn)
+{
+	IKCPSEG *seg;
+	if (kcp->snd_ring_size == 0) return NULL;
+	seg = kcp->snd_ring[sn & (kcp->snd_ring_size - 1)];
+	return (seg && seg->sn == sn)? seg : NULL;
+}
+
+// take an acknowledged segment out of snd_buf and every index on it
+static void ikcp_snd_buf_remove(ikcpcb *kcp, IKCPSEG *seg)
+{
+	kcp->snd_ring[seg->sn & (kcp->snd_ring_size - 1)] = NULL;
+	iqueue_del(&seg->node);
+	ikcp_snd_heap_remove(kcp, seg);
+	if (!iqueue_is_empty(&seg->fast_node)) {
+		iqueue_del(&seg->fast_node);
+	}
+	ikcp_segment_delete(kcp, seg);
+	kcp->nsnd_buf--;
 }
 
 // write log
@@ -233,8 +519,16 @@ void ikcp_qprint(const char *name, const struct IQUEUEHEAD *head)
 //---------------------------------------------------------------------
 ikcpcb* ikcp_create(IUINT32 conv, void *user)
 {
-	ikcpcb *kcp = (ikcpcb*)ikcp_malloc(sizeof(struct IKCPCB));
+	return ikcp_create_ex(conv, user, NULL);
+}
+
+ikcpcb* ikcp_create_ex(IUINT32 conv, void *user, const ikcpalloc *allocator)
+{
+	ikcpcb *kcp = (ikcpcb*)((allocator != NULL)? 
+		allocator->alloc(sizeof(struct IKCPCB), allocator->ctx) : 
+		ikcp_malloc(sizeof(struct IKCPCB)));
 	if (kcp == NULL) return NULL;
+	kcp->allocator = allocator;
 	kcp->conv = conv;
 	kcp->user = user;
 	kcp->snd_una = 0;
@@ -254,16 +548,20 @@ ikcpcb* ikcp_create(IUINT32 conv, void *user)
 	kcp->mss = kcp->mtu - IKCP_OVERHEAD;
 	kcp->stream = 0;
 
-	kcp->buffer = (char*)ikcp_malloc((kcp->mtu + IKCP_OVERHEAD) * 3);
-	if (kcp->buffer == NULL) {
-		ikcp_free(kcp);
-		return NULL;
-	}
+	kcp->buffer = NULL;
 
 	iqueue_init(&kcp->snd_queue);
 	iqueue_init(&kcp->rcv_queue);
 	iqueue_init(&kcp->snd_buf);
-	iqueue_init(&kcp->rcv_buf);
+	iqueue_init(&kcp->snd_fast);
+	kcp->snd_heap = NULL;
+	kcp->snd_heap_size = 0;
+	kcp->snd_heap_block = 0;
+	kcp->snd_ring = NULL;
+	kcp->snd_ring_size = 0;
+	kcp->rcv_ring = NULL;
+	kcp->rcv_ring_map = NULL;
+	kcp->rcv_ring_size = 0;
 	kcp->nrcv_buf = 0;
 	kcp->nsnd_buf = 0;
 	kcp->nrcv_que = 0;
@@ -308,10 +606,13 @@ void ikcp_release(ikcpcb *kcp)
 			iqueue_del(&seg->node);
 			ikcp_segment_delete(kcp, seg);
 		}
-		while (!iqueue_is_empty(&kcp->rcv_buf)) {
-			seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-			iqueue_del(&seg->node);
-			ikcp_segment_delete(kcp, seg);
+		if (kcp->rcv_ring) {
+			IUINT32 i;
+			for (i = 0; i < kcp->rcv_ring_size; i++) {
+				if (IKCP_RING_TEST(kcp->rcv_ring_map, i))
+					ikcp_segment_delete(kcp, kcp->rcv_ring[i]);
+			}
+			ikcp_rcv_ring_free(kcp);
 		}
 		while (!iqueue_is_empty(&kcp->snd_queue)) {
 			seg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
@@ -324,10 +625,16 @@ void ikcp_release(ikcpcb *kcp)
 			ikcp_segment_delete(kcp, seg);
 		}
 		if (kcp->buffer) {
-			ikcp_free(kcp->buffer);
+			ikcp_kfree(kcp, kcp->buffer, (kcp->mtu + IKCP_OVERHEAD) * 3);
 		}
 		if (kcp->acklist) {
-			ikcp_free(kcp->acklist);
+			ikcp_kfree(kcp, kcp->acklist, kcp->ackblock * sizeof(IUINT32) * 2);
+		}
+		if (kcp->snd_heap) {
+			ikcp_kfree(kcp, kcp->snd_heap, sizeof(IKCPSEG*) * kcp->snd_heap_block);
+		}
+		if (kcp->snd_ring) {
+			ikcp_kfree(kcp, kcp->snd_ring, sizeof(IKCPSEG*) * kcp->snd_ring_size);
 		}
 
 		kcp->nrcv_buf = 0;
@@ -337,7 +644,11 @@ void ikcp_release(ikcpcb *kcp)
 		kcp->ackcount = 0;
 		kcp->buffer = NULL;
 		kcp->acklist = NULL;
-		ikcp_free(kcp);
+		kcp->snd_heap = NULL;
+		kcp->snd_heap_size = 0;
+		kcp->snd_ring = NULL;
+		kcp->snd_ring_size = 0;
+		ikcp_kfree(kcp, kcp, sizeof(struct IKCPCB));
 	}
 }
 
@@ -352,6 +663,20 @@ void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len,
 }
 
 
+// after a message left rcv_queue: pull in-order segments from the ring
+// and tell the peer the window reopened if it was full
+static void ikcp_recv_refill(ikcpcb *kcp, int recover)
+{
+	ikcp_rcv_ring_deliver(kcp);
+
+	// fast recover
+	if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
+		// ready to send back IKCP_CMD_WINS in ikcp_flush
+		// tell remote my window size
+		kcp->probe |= IKCP_ASK_TELL;
+	}
+}
+
 //---------------------------------------------------------------------
 // user/upper level recv: returns size, returns below zero for EAGAIN
 //---------------------------------------------------------------------
@@ -410,28 +735,78 @@ int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
 
 	assert(len == peeksize);
 
-	// move available data from rcv_buf -> rcv_queue
-	while (! iqueue_is_empty(&kcp->rcv_buf)) {
-		seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
+	ikcp_recv_refill(kcp, recover);
+
+	return len;
+}
+
+
+//---------------------------------------------------------------------
+// zero-copy recv: hand the next message over as a single segment
+//---------------------------------------------------------------------
+int ikcp_recv_view(ikcpcb *kcp, IKCPSEG **view)
+{
+	IKCPSEG *seg, *first;
+	int peeksize, recover = 0;
+	assert(kcp);
+
+	if (iqueue_is_empty(&kcp->rcv_queue))
+		return -1;
+
+	peeksize = ikcp_peeksize(kcp);
+
+	if (peeksize < 0) 
+		return -2;
+
+	if (kcp->nrcv_que >= kcp->rcv_wnd)
+		recover = 1;
+
+	first = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
+	if (first->frg == 0) {
+		// single fragment: the segment itself is the view
+		iqueue_del(&first->node);
+		kcp->nrcv_que--;
+		*view = first;
+	}	else {
+		// several fragments are gathered into one block from the same allocator
+		char *ptr;
+		*view = ikcp_segment_new(kcp, peeksize);
+		if (*view == NULL) 
+			return -2;
+		ptr = (*view)->data;
+		while (1) {
+			int fragment;
+			seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
+			memcpy(ptr, seg->data, seg->len);
+			ptr += seg->len;
+			fragment = seg->frg;
 			iqueue_del(&seg->node);
-			kcp->nrcv_buf--;
-			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-			kcp->nrcv_que++;
-			kcp->rcv_nxt++;
-		}	else {
-			break;
+			ikcp_segment_delete(kcp, seg);
+			kcp->nrcv_que--;
+			if (fragment == 0) 
+				break;
 		}
+		(*view)->len = peeksize;
+		(*view)->frg = 0;
 	}
 
-	// fast recover
-	if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
-		// ready to send back IKCP_CMD_WINS in ikcp_flush
-		// tell remote my window size
-		kcp->probe |= IKCP_ASK_TELL;
+	if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
+		ikcp_log(kcp, IKCP_LOG_RECV, "recv view len=%d", peeksize);
 	}
 
-	return len;
+	ikcp_recv_refill(kcp, recover);
+
+	return peeksize;
+}
+
+void ikcp_view_release(const ikcpalloc *allocator, IKCPSEG *view)
+{
+	size_t size = sizeof(IKCPSEG) + view->len;
+	if (allocator) {
+		allocator->release(view, size, allocator->ctx);
+	}	else {
+		ikcp_free(view);
+	}
 }
 
 
@@ -464,16 +839,63 @@ int ikcp_peeksize(const ikcpcb *kcp)
 
 
 //---------------------------------------------------------------------
-// user/upper level send, returns below zero for error
+// send source: scatter-gather input of ikcp_send/ikcp_sendv/ikcp_send_ref
 //---------------------------------------------------------------------
-int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
+// source of ikcp_send_segments: the buffers of a send, consumed in order
+typedef struct
+{
+	const ikcpvec *vec;
+	int count;
+	int offset;		// bytes already taken from vec[0]
+}	ikcp_source;
+
+// current read position, only meaningful while a single buffer is left
+static inline const char *ikcp_source_ptr(const ikcp_source *src)
+{
+	return (src->count > 0 && src->vec->data)? src->vec->data + src->offset : NULL;
+}
+
+// take 'size' bytes from the source, copying them to dst when both exist
+static void ikcp_source_take(ikcp_source *src, char *dst, int size)
+{
+	while (size > 0 && src->count > 0) {
+		int avail = src->vec->len - src->offset;
+		int n = (size < avail)? size : avail;
+		if (dst && src->vec->data) {
+			memcpy(dst, src->vec->data + src->offset, n);
+			dst += n;
+		}
+		src->offset += n;
+		size -= n;
+		if (src->offset == src->vec->len) {
+			src->vec++;
+			src->count--;
+			src->offset = 0;
+		}
+	}
+}
+
+static int ikcp_send_segments(ikcpcb *kcp, const ikcpvec *vec, int nvec, 
+	struct IKCPREF *ref)
 {
 	IKCPSEG *seg;
+	ikcp_source src;
 	int count, i;
 	int sent = 0;
+	long total = 0;
+	int len;
 
 	assert(kcp->mss > 0);
-	if (len < 0) return -1;
+	if (nvec < 0) return -1;
+	for (i = 0; i < nvec; i++) {
+		if (vec[i].len < 0) return -1;
+		total += vec[i].len;
+		if (total > 0x7fffffff) return -1;
+	}
+	len = (int)total;
+	src.vec = vec;
+	src.count = nvec;
+	src.offset = 0;
 
 	// append to previous segment in streaming mode (if possible)
 	if (kcp->stream != 0) {
@@ -488,11 +910,8 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 					return -2;
 				}
 				iqueue_add_tail(&seg->node, &kcp->snd_queue);
-				memcpy(seg->data, old->data, old->len);
-				if (buffer) {
-					memcpy(seg->data + old->len, buffer, extend);
-					buffer += extend;
-				}
+				memcpy(seg->data, ikcp_segment_data(old), old->len);
+				ikcp_source_take(&src, seg->data + old->len, extend);
 				seg->len = old->len + extend;
 				seg->frg = 0;
 				len -= extend;
@@ -520,22 +939,29 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 	// fragment
 	for (i = 0; i < count; i++) {
 		int size = len > (int)kcp->mss ? (int)kcp->mss : len;
-		seg = ikcp_segment_new(kcp, size);
-		assert(seg);
-		if (seg == NULL) {
-			return -2;
-		}
-		if (buffer && len > 0) {
-			memcpy(seg->data, buffer, size);
+		if (ref != NULL && ikcp_source_ptr(&src) && size > 0) {
+			seg = ikcp_segment_new(kcp, 0);
+			assert(seg);
+			if (seg == NULL) {
+				return -2;
+			}
+			seg->ref = ref;
+			seg->ext = ikcp_source_ptr(&src);
+			ref->count++;
+			ikcp_source_take(&src, NULL, size);
+		}	else {
+			seg = ikcp_segment_new(kcp, size);
+			assert(seg);
+			if (seg == NULL) {
+				return -2;
+			}
+			ikcp_source_take(&src, seg->data, size);
 		}
 		seg->len = size;
 		seg->frg = (kcp->stream == 0)? (count - i - 1) : 0;
 		iqueue_init(&seg->node);
 		iqueue_add_tail(&seg->node, &kcp->snd_queue);
 		kcp->nsnd_que++;
-		if (buffer) {
-			buffer += size;
-		}
 		len -= size;
 		sent += size;
 	}
@@ -543,6 +969,44 @@ int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
 	return sent;
 }
 
+//---------------------------------------------------------------------
+// user/upper level send, returns below zero for error
+//---------------------------------------------------------------------
+int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
+{
+	ikcpvec vec;
+	vec.data = buffer;
+	vec.len = len;
+	return ikcp_send_segments(kcp, &vec, 1, NULL);
+}
+
+int ikcp_sendv(ikcpcb *kcp, const ikcpvec *vec, int count)
+{
+	return ikcp_send_segments(kcp, vec, count, NULL);
+}
+
+int ikcp_send_ref(ikcpcb *kcp, const char *buffer, int len, 
+	void (*release)(void *opaque), void *opaque)
+{
+	struct IKCPREF *ref;
+	ikcpvec vec;
+	int sent;
+	ref = (struct IKCPREF*)ikcp_kmalloc(kcp, sizeof(struct IKCPREF));
+	if (ref == NULL) {
+		release(opaque);
+		return -2;
+	}
+	// this call holds one reference until every fragment is queued
+	ref->count = 1;
+	ref->release = release;
+	ref->opaque = opaque;
+	vec.data = buffer;
+	vec.len = len;
+	sent = ikcp_send_segments(kcp, &vec, 1, ref);
+	ikcp_ref_put(kcp, ref);
+	return sent;
+}
+
 
 //---------------------------------------------------------------------
 // parse ack
@@ -577,42 +1041,44 @@ static void ikcp_shrink_buf(ikcpcb *kcp)
 
 static void ikcp_parse_ack(ikcpcb *kcp, IUINT32 sn)
 {
-	struct IQUEUEHEAD *p, *next;
+	IKCPSEG *seg;
 
 	if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
 		return;
 
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		next = p->next;
-		if (sn == seg->sn) {
-			iqueue_del(p);
-			ikcp_segment_delete(kcp, seg);
-			kcp->nsnd_buf--;
-			break;
-		}
-		if (_itimediff(sn, seg->sn) < 0) {
-			break;
-		}
+	seg = ikcp_snd_ring_get(kcp, sn);
+	if (seg != NULL) {
+		ikcp_snd_buf_remove(kcp, seg);
 	}
 }
 
+// snd_una only moves forward, so the slots walked here are paid for once
 static void ikcp_parse_una(ikcpcb *kcp, IUINT32 una)
 {
-	struct IQUEUEHEAD *p, *next;
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		next = p->next;
-		if (_itimediff(una, seg->sn) > 0) {
-			iqueue_del(p);
-			ikcp_segment_delete(kcp, seg);
-			kcp->nsnd_buf--;
-		}	else {
-			break;
+	IUINT32 sn;
+	if (_itimediff(una, kcp->snd_nxt) > 0) 
+		una = kcp->snd_nxt;
+	for (sn = kcp->snd_una; kcp->nsnd_buf > 0 && _itimediff(una, sn) > 0; sn++) {
+		IKCPSEG *seg = ikcp_snd_ring_get(kcp, sn);
+		if (seg != NULL) {
+			ikcp_snd_buf_remove(kcp, seg);
 		}
 	}
 }
 
+// queue a segment for fast retransmit once enough acks have skipped it,
+// segments that already hit fastlimit are never resent by ikcp_flush
+static void ikcp_fast_candidate(ikcpcb *kcp, IKCPSEG *seg)
+{
+	if (kcp->fastresend <= 0 || seg->fastack < (IUINT32)kcp->fastresend)
+		return;
+	if (!iqueue_is_empty(&seg->fast_node))
+		return;
+	if ((int)seg->xmit > kcp->fastlimit && kcp->fastlimit > 0)
+		return;
+	iqueue_add_tail(&seg->fast_node, &kcp->snd_fast);
+}
+
 static void ikcp_parse_fastack(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
 {
 	struct IQUEUEHEAD *p, *next;
@@ -633,6 +1099,7 @@ static void ikcp_parse_fastack(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
 			if (_itimediff(ts, seg->ts) >= 0)
 				seg->fastack++;
 		#endif
+			ikcp_fast_candidate(kcp, seg);
 		}
 	}
 }
@@ -651,7 +1118,7 @@ static void ikcp_ack_push(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
 		IUINT32 newblock;
 
 		for (newblock = 8; newblock < newsize; newblock <<= 1);
-		acklist = (IUINT32*)ikcp_malloc(newblock * sizeof(IUINT32) * 2);
+		acklist = (IUINT32*)ikcp_kmalloc(kcp, newblock * sizeof(IUINT32) * 2);
 
 		if (acklist == NULL) {
 			assert(acklist != NULL);
@@ -664,7 +1131,7 @@ static void ikcp_ack_push(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
 				acklist[x * 2 + 0] = kcp->acklist[x * 2 + 0];
 				acklist[x * 2 + 1] = kcp->acklist[x * 2 + 1];
 			}
-			ikcp_free(kcp->acklist);
+			ikcp_kfree(kcp, kcp->acklist, kcp->ackblock * sizeof(IUINT32) * 2);
 		}
 
 		kcp->acklist = acklist;
@@ -689,9 +1156,7 @@ static void ikcp_ack_get(const ikcpcb *kcp, int p, IUINT32 *sn, IUINT32 *ts)
 //---------------------------------------------------------------------
 void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 {
-	struct IQUEUEHEAD *p, *prev;
 	IUINT32 sn = newseg->sn;
-	int repeat = 0;
 	
 	if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) >= 0 ||
 		_itimediff(sn, kcp->rcv_nxt) < 0) {
@@ -699,44 +1164,17 @@ void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
 		return;
 	}
 
-	for (p = kcp->rcv_buf.prev; p != &kcp->rcv_buf; p = prev) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		prev = p->prev;
-		if (seg->sn == sn) {
-			repeat = 1;
-			break;
-		}
-		if (_itimediff(sn, seg->sn) > 0) {
-			break;
-		}
+	if (kcp->rcv_ring_size != ikcp_rcv_ring_capacity(kcp->rcv_wnd) && 
+		ikcp_rcv_ring_resize(kcp) < 0) {
+		ikcp_segment_delete(kcp, newseg);
+		return;
 	}
 
-	if (repeat == 0) {
-		iqueue_init(&newseg->node);
-		iqueue_add(&newseg->node, p);
-		kcp->nrcv_buf++;
-	}	else {
+	if (ikcp_rcv_ring_insert(kcp, newseg) < 0) {
 		ikcp_segment_delete(kcp, newseg);
 	}
 
-#if 0
-	ikcp_qprint("rcvbuf", &kcp->rcv_buf);
-	printf("rcv_nxt=%lu\n", kcp->rcv_nxt);
-#endif
-
-	// move available data from rcv_buf -> rcv_queue
-	while (! iqueue_is_empty(&kcp->rcv_buf)) {
-		IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-			iqueue_del(&seg->node);
-			kcp->nrcv_buf--;
-			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-			kcp->nrcv_que++;
-			kcp->rcv_nxt++;
-		}	else {
-			break;
-		}
-	}
+	ikcp_rcv_ring_deliver(kcp);
 
 #if 0
 	ikcp_qprint("queue", &kcp->rcv_queue);
@@ -932,18 +1370,48 @@ static int ikcp_wnd_unused(const ikcpcb *kcp)
 }
 
 
+// append one data segment to the flush buffer, emitting it first if full
+static char *ikcp_flush_seg(ikcpcb *kcp, char *buffer, char *ptr, IKCPSEG *segment, 
+	IUINT32 wnd)
+{
+	int size = (int)(ptr - buffer);
+	int need = IKCP_OVERHEAD + segment->len;
+
+	segment->ts = kcp->current;
+	segment->wnd = wnd;
+	segment->una = kcp->rcv_nxt;
+
+	if (size + need > (int)kcp->mtu) {
+		ikcp_output(kcp, buffer, size);
+		ptr = buffer;
+	}
+
+	ptr = ikcp_encode_seg(ptr, segment);
+
+	if (segment->len > 0) {
+		memcpy(ptr, ikcp_segment_data(segment), segment->len);
+		ptr += segment->len;
+	}
+
+	if (segment->xmit >= kcp->dead_link) {
+		kcp->state = (IUINT32)-1;
+	}
+	return ptr;
+}
+
+
 //---------------------------------------------------------------------
 // ikcp_flush
 //---------------------------------------------------------------------
 void ikcp_flush(ikcpcb *kcp)
 {
 	IUINT32 current = kcp->current;
-	char *buffer = kcp->buffer;
+	char *buffer = (kcp->buffer != NULL)? kcp->buffer : ikcp_flush_buffer;
 	char *ptr = buffer;
 	int count, size, i;
 	IUINT32 resent, cwnd;
 	IUINT32 rtomin;
-	struct IQUEUEHEAD *p;
+	struct IQUEUEHEAD *p, *next, *fresh;
 	int change = 0;
 	int lost = 0;
 	IKCPSEG seg;
@@ -1024,7 +1492,8 @@ void ikcp_flush(ikcpcb *kcp)
 	cwnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
 	if (kcp->nocwnd == 0) cwnd = _imin_(kcp->cwnd, cwnd);
 
-	// move data from snd_queue to snd_buf
+	// move data from snd_queue to snd_buf, new segments are sent last
+	fresh = kcp->snd_buf.prev;
 	while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
 		IKCPSEG *newseg;
 		if (iqueue_is_empty(&kcp->snd_queue)) break;
@@ -1041,6 +1510,7 @@ void ikcp_flush(ikcpcb *kcp)
 		newseg->wnd = seg.wnd;
 		newseg->ts = current;
 		newseg->sn = kcp->snd_nxt++;
+		ikcp_snd_ring_add(kcp, newseg);
 		newseg->una = kcp->rcv_nxt;
 		newseg->resendts = current;
 		newseg->rto = kcp->rx_rto;
@@ -1052,70 +1522,59 @@ void ikcp_flush(ikcpcb *kcp)
 	resent = (kcp->fastresend > 0)? (IUINT32)kcp->fastresend : 0xffffffff;
 	rtomin = (kcp->nodelay == 0)? (kcp->rx_rto >> 3) : 0;
 
-	// flush data segments
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
-		IKCPSEG *segment = iqueue_entry(p, IKCPSEG, node);
-		int needsend = 0;
-		if (segment->xmit == 0) {
-			needsend = 1;
-			segment->xmit++;
-			segment->rto = kcp->rx_rto;
-			segment->resendts = current + segment->rto + rtomin;
-		}
-		else if (_itimediff(current, segment->resendts) >= 0) {
-			needsend = 1;
+	// fast retransmit, segments that also timed out are left to the rto pass
+	for (p = kcp->snd_fast.next; p != &kcp->snd_fast; p = next) {
+		IKCPSEG *segment = iqueue_entry(p, IKCPSEG, fast_node);
+		next = p->next;
+		if (_itimediff(current, segment->resendts) >= 0) 
+			continue;
+		iqueue_del_init(p);
+		if (segment->fastack < resent) 
+			continue;
+		if ((int)segment->xmit <= kcp->fastlimit || 
+			kcp->fastlimit <= 0) {
 			segment->xmit++;
-			kcp->xmit++;
-			if (kcp->nodelay == 0) {
-				segment->rto += _imax_(segment->rto, (IUINT32)kcp->rx_rto);
-			}	else {
-				IINT32 step = (kcp->nodelay < 2)? 
-					((IINT32)(segment->rto)) : kcp->rx_rto;
-				segment->rto += step / 2;
-			}
+			segment->fastack = 0;
 			segment->resendts = current + segment->rto;
-			lost = 1;
+			ikcp_snd_heap_down(kcp, segment->heap_index);
+			change++;
+			ptr = ikcp_flush_seg(kcp, buffer, ptr, segment, seg.wnd);
 		}
-		else if (segment->fastack >= resent) {
-			if ((int)segment->xmit <= kcp->fastlimit || 
-				kcp->fastlimit <= 0) {
-				needsend = 1;
-				segment->xmit++;
-				segment->fastack = 0;
-				segment->resendts = current + segment->rto;
-				change++;
-			}
-		}
-
-		if (needsend) {
-			int need;
-			segment->ts = current;
-			segment->wnd = seg.wnd;
-			segment->una = kcp->rcv_nxt;
-
-			size = (int)(ptr - buffer);
-			need = IKCP_OVERHEAD + segment->len;
-
-			if (size + need > (int)kcp->mtu) {
-				ikcp_output(kcp, buffer, size);
-				ptr = buffer;
-			}
-
-			ptr = ikcp_encode_seg(ptr, segment);
-
-			if (segment->len > 0) {
-				memcpy(ptr, segment->data, segment->len);
-				ptr += segment->len;
-			}
+	}
 
-			if (segment->xmit >= kcp->dead_link) {
-				kcp->state = (IUINT32)-1;
-			}
+	// retransmit segments whose rto expired, each one at most once
+	for (count = (int)kcp->snd_heap_size; count > 0; count--) {
+		IKCPSEG *segment;
+		if (kcp->snd_heap_size == 0) break;
+		segment = kcp->snd_heap[0];
+		if (_itimediff(current, segment->resendts) < 0) break;
+		segment->xmit++;
+		kcp->xmit++;
+		if (kcp->nodelay == 0) {
+			segment->rto += _imax_(segment->rto, (IUINT32)kcp->rx_rto);
+		}	else {
+			IINT32 step = (kcp->nodelay < 2)? 
+				((IINT32)(segment->rto)) : kcp->rx_rto;
+			segment->rto += step / 2;
 		}
+		segment->resendts = current + segment->rto;
+		ikcp_snd_heap_down(kcp, 0);
+		lost = 1;
+		ptr = ikcp_flush_seg(kcp, buffer, ptr, segment, seg.wnd);
+	}
+
+	// first transmission of the segments moved in above
+	for (p = fresh->next; p != &kcp->snd_buf; p = p->next) {
+		IKCPSEG *segment = iqueue_entry(p, IKCPSEG, node);
+		segment->xmit++;
+		segment->rto = kcp->rx_rto;
+		segment->resendts = current + segment->rto + rtomin;
+		ikcp_snd_heap_push(kcp, segment);
+		ptr = ikcp_flush_seg(kcp, buffer, ptr, segment, seg.wnd);
 	}
 
-	// flash remain segments
 	size = (int)(ptr - buffer);
+	// flash remain segments
 	if (size > 0) {
 		ikcp_output(kcp, buffer, size);
 	}
@@ -1193,7 +1652,6 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 	IINT32 tm_flush = 0x7fffffff;
 	IINT32 tm_packet = 0x7fffffff;
 	IUINT32 minimal = 0;
-	struct IQUEUEHEAD *p;
 
 	if (kcp->updated == 0) {
 		return current;
@@ -1210,13 +1668,12 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 
 	tm_flush = _itimediff(ts_flush, current);
 
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
-		const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
-		IINT32 diff = _itimediff(seg->resendts, current);
+	if (kcp->snd_heap_size > 0) {
+		IINT32 diff = _itimediff(kcp->snd_heap[0]->resendts, current);
 		if (diff <= 0) {
 			return current;
 		}
-		if (diff < tm_packet) tm_packet = diff;
+		tm_packet = diff;
 	}
 
 	minimal = (IUINT32)(tm_packet < tm_flush ? tm_packet : tm_flush);
@@ -1229,15 +1686,19 @@ IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
 
 int ikcp_setmtu(ikcpcb *kcp, int mtu)
 {
-	char *buffer;
+	char *buffer = NULL;
 	if (mtu < 50 || mtu < (int)IKCP_OVERHEAD) 
 		return -1;
-	buffer = (char*)ikcp_malloc((mtu + IKCP_OVERHEAD) * 3);
-	if (buffer == NULL) 
-		return -2;
+	if ((mtu + IKCP_OVERHEAD) * 3 > IKCP_FLUSH_BUFFER) {
+		buffer = (char*)ikcp_kmalloc(kcp, (mtu + IKCP_OVERHEAD) * 3);
+		if (buffer == NULL) 
+			return -2;
+	}
+	if (kcp->buffer) {
+		ikcp_kfree(kcp, kcp->buffer, (kcp->mtu + IKCP_OVERHEAD) * 3);
+	}
 	kcp->mtu = mtu;
 	kcp->mss = kcp->mtu - IKCP_OVERHEAD;
-	ikcp_free(kcp->buffer);
 	kcp->buffer = buffer;
 	return 0;
 }
@@ -1284,6 +1745,9 @@ int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd)
 		}
 		if (rcvwnd > 0) {   // must >= max fragment size
 			kcp->rcv_wnd = _imax_(rcvwnd, IKCP_WND_RCV);
+			if (kcp->rcv_ring && 
+				kcp->rcv_ring_size != ikcp_rcv_ring_capacity(kcp->rcv_wnd))
+				ikcp_rcv_ring_resize(kcp);
 		}
 	}
 	return 0;
@@ -1303,6 +1767,253 @@ IUINT32 ikcp_getconv(const void *ptr)
 	return conv;
 }
 
+
+//---------------------------------------------------------------------
+// snapshot / restore, used to hand connections over to a new process
+//---------------------------------------------------------------------
+#define IKCP_SNAPSHOT_VERSION 1
+#define IKCP_SNAPSHOT_FIELDS 31
+#define IKCP_SNAPSHOT_SEG_FIELDS 12
+
+static int ikcp_snapshot_fields(ikcpcb *kcp, IUINT32 **fields)
+{
+	int n = 0;
+	fields[n++] = &kcp->state;
+	fields[n++] = &kcp->snd_una;
+	fields[n++] = &kcp->snd_nxt;
+	fields[n++] = &kcp->rcv_nxt;
+	fields[n++] = &kcp->ts_recent;
+	fields[n++] = &kcp->ts_lastack;
+	fields[n++] = &kcp->ssthresh;
+	fields[n++] = (IUINT32*)&kcp->rx_rttval;
+	fields[n++] = (IUINT32*)&kcp->rx_srtt;
+	fields[n++] = (IUINT32*)&kcp->rx_rto;
+	fields[n++] = (IUINT32*)&kcp->rx_minrto;
+	fields[n++] = &kcp->snd_wnd;
+	fields[n++] = &kcp->rcv_wnd;
+	fields[n++] = &kcp->rmt_wnd;
+	fields[n++] = &kcp->cwnd;
+	fields[n++] = &kcp->probe;
+	fields[n++] = &kcp->current;
+	fields[n++] = &kcp->interval;
+	fields[n++] = &kcp->ts_flush;
+	fields[n++] = &kcp->xmit;
+	fields[n++] = &kcp->nodelay;
+	fields[n++] = &kcp->updated;
+	fields[n++] = &kcp->ts_probe;
+	fields[n++] = &kcp->probe_wait;
+	fields[n++] = &kcp->dead_link;
+	fields[n++] = &kcp->incr;
+	fields[n++] = (IUINT32*)&kcp->fastresend;
+	fields[n++] = (IUINT32*)&kcp->fastlimit;
+	fields[n++] = (IUINT32*)&kcp->nocwnd;
+	fields[n++] = (IUINT32*)&kcp->stream;
+	fields[n++] = (IUINT32*)&kcp->logmask;
+	assert(n == IKCP_SNAPSHOT_FIELDS);
+	return n;
+}
+
+static int ikcp_snapshot_queue_size(const struct IQUEUEHEAD *head)
+{
+	const struct IQUEUEHEAD *p;
+	int size = 4;
+	for (p = head->next; p != head; p = p->next) {
+		const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
+		size += IKCP_SNAPSHOT_SEG_FIELDS * 4 + (int)seg->len;
+	}
+	return size;
+}
+
+static int ikcp_snapshot_ring_size(const ikcpcb *kcp)
+{
+	int size = 4;
+	IUINT32 i;
+	for (i = 0; kcp->rcv_ring && i < kcp->rcv_ring_size; i++) {
+		if (IKCP_RING_TEST(kcp->rcv_ring_map, i))
+			size += IKCP_SNAPSHOT_SEG_FIELDS * 4 + (int)kcp->rcv_ring[i]->len;
+	}
+	return size;
+}
+
+static char *ikcp_snapshot_seg(char *ptr, const IKCPSEG *seg)
+{
+	ptr = ikcp_encode32u(ptr, seg->conv);
+	ptr = ikcp_encode32u(ptr, seg->cmd);
+	ptr = ikcp_encode32u(ptr, seg->frg);
+	ptr = ikcp_encode32u(ptr, seg->wnd);
+	ptr = ikcp_encode32u(ptr, seg->ts);
+	ptr = ikcp_encode32u(ptr, seg->sn);
+	ptr = ikcp_encode32u(ptr, seg->una);
+	ptr = ikcp_encode32u(ptr, seg->len);
+	ptr = ikcp_encode32u(ptr, seg->resendts);
+	ptr = ikcp_encode32u(ptr, seg->rto);
+	ptr = ikcp_encode32u(ptr, seg->fastack);
+	ptr = ikcp_encode32u(ptr, seg->xmit);
+	if (seg->len > 0) {
+		memcpy(ptr, ikcp_segment_data(seg), seg->len);
+		ptr += seg->len;
+	}
+	return ptr;
+}
+
+// receive ring is written in sn order, same layout as a queue
+static char *ikcp_snapshot_ring(char *ptr, const ikcpcb *kcp)
+{
+	IUINT32 k;
+	ptr = ikcp_encode32u(ptr, kcp->nrcv_buf);
+	for (k = 0; kcp->rcv_ring && k < kcp->rcv_ring_size; k++) {
+		IUINT32 index = (kcp->rcv_nxt + k) & (kcp->rcv_ring_size - 1);
+		if (IKCP_RING_TEST(kcp->rcv_ring_map, index))
+			ptr = ikcp_snapshot_seg(ptr, kcp->rcv_ring[index]);
+	}
+	return ptr;
+}
+
+static char *ikcp_snapshot_queue(char *ptr, const struct IQUEUEHEAD *head, IUINT32 count)
+{
+	const struct IQUEUEHEAD *p;
+	ptr = ikcp_encode32u(ptr, count);
+	for (p = head->next; p != head; p = p->next) {
+		const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
+		ptr = ikcp_snapshot_seg(ptr, seg);
+	}
+	return ptr;
+}
+
+static const char *ikcp_restore_queue(ikcpcb *kcp, const char *ptr, const char *end,
+	struct IQUEUEHEAD *head, IUINT32 *count)
+{
+	IUINT32 n, i;
+	if (ptr == NULL || end - ptr < 4) return NULL;
+	ptr = ikcp_decode32u(ptr, &n);
+	for (i = 0; i < n; i++) {
+		IUINT32 f[IKCP_SNAPSHOT_SEG_FIELDS];
+		IKCPSEG *seg;
+		int k;
+		if (end - ptr < IKCP_SNAPSHOT_SEG_FIELDS * 4) return NULL;
+		for (k = 0; k < IKCP_SNAPSHOT_SEG_FIELDS; k++)
+			ptr = ikcp_decode32u(ptr, &f[k]);
+		if ((IUINT32)(end - ptr) < f[7]) return NULL;
+		seg = ikcp_segment_new(kcp, (int)f[7]);
+		if (seg == NULL) return NULL;
+		seg->conv = f[0]; seg->cmd = f[1]; seg->frg = f[2]; seg->wnd = f[3];
+		seg->ts = f[4]; seg->sn = f[5]; seg->una = f[6]; seg->len = f[7];
+		seg->resendts = f[8]; seg->rto = f[9]; seg->fastack = f[10]; seg->xmit = f[11];
+		if (seg->len > 0) {
+			memcpy(seg->data, ptr, seg->len);
+			ptr += seg->len;
+		}
+		iqueue_init(&seg->node);
+		iqueue_add_tail(&seg->node, head);
+		(*count)++;
+	}
+	return ptr;
+}
+
+int ikcp_snapshot(const ikcpcb *kcp, char *buffer, int len)
+{
+	IUINT32 *fields[IKCP_SNAPSHOT_FIELDS];
+	char *ptr = buffer;
+	int size, n, i;
+
+	size = 4 * 3 + IKCP_SNAPSHOT_FIELDS * 4 + 4 + (int)kcp->ackcount * 8;
+	size += ikcp_snapshot_queue_size(&kcp->snd_queue);
+	size += ikcp_snapshot_queue_size(&kcp->snd_buf);
+	size += ikcp_snapshot_ring_size(kcp);
+	size += ikcp_snapshot_queue_size(&kcp->rcv_queue);
+	if (buffer == NULL) return size;
+	if (len < size) return -1;
+
+	ptr = ikcp_encode32u(ptr, IKCP_SNAPSHOT_VERSION);
+	ptr = ikcp_encode32u(ptr, kcp->conv);
+	ptr = ikcp_encode32u(ptr, kcp->mtu);
+	n = ikcp_snapshot_fields((ikcpcb*)kcp, fields);
+	for (i = 0; i < n; i++)
+		ptr = ikcp_encode32u(ptr, *fields[i]);
+	ptr = ikcp_encode32u(ptr, kcp->ackcount);
+	for (i = 0; i < (int)kcp->ackcount * 2; i++)
+		ptr = ikcp_encode32u(ptr, kcp->acklist[i]);
+	ptr = ikcp_snapshot_queue(ptr, &kcp->snd_queue, kcp->nsnd_que);
+	ptr = ikcp_snapshot_queue(ptr, &kcp->snd_buf, kcp->nsnd_buf);
+	ptr = ikcp_snapshot_ring(ptr, kcp);
+	ptr = ikcp_snapshot_queue(ptr, &kcp->rcv_queue, kcp->nrcv_que);
+	assert(ptr - buffer == size);
+	return size;
+}
+
+ikcpcb* ikcp_restore(const char *buffer, int len, void *user, const ikcpalloc *allocator)
+{
+	IUINT32 *fields[IKCP_SNAPSHOT_FIELDS];
+	const char *ptr = buffer, *end = buffer + len;
+	IUINT32 version, conv, mtu, ackcount, i, nrcv_buf = 0;
+	struct IQUEUEHEAD rcv_buf;
+	ikcpcb *kcp;
+	int n, k;
+
+	if (len < 4 * 3 + IKCP_SNAPSHOT_FIELDS * 4 + 4) return NULL;
+	ptr = ikcp_decode32u(ptr, &version);
+	ptr = ikcp_decode32u(ptr, &conv);
+	ptr = ikcp_decode32u(ptr, &mtu);
+	if (version != IKCP_SNAPSHOT_VERSION) return NULL;
+
+	kcp = ikcp_create_ex(conv, user, allocator);
+	if (kcp == NULL) return NULL;
+	if (mtu != kcp->mtu && ikcp_setmtu(kcp, (int)mtu) < 0) {
+		ikcp_release(kcp);
+		return NULL;
+	}
+	n = ikcp_snapshot_fields(kcp, fields);
+	for (k = 0; k < n; k++)
+		ptr = ikcp_decode32u(ptr, fields[k]);
+	ptr = ikcp_decode32u(ptr, &ackcount);
+	if ((IUINT32)(end - ptr) / 8 < ackcount) {
+		ikcp_release(kcp);
+		return NULL;
+	}
+	for (i = 0; i < ackcount; i++) {
+		IUINT32 sn, ts;
+		ptr = ikcp_decode32u(ptr, &sn);
+		ptr = ikcp_decode32u(ptr, &ts);
+		ikcp_ack_push(kcp, sn, ts);
+	}
+	ptr = ikcp_restore_queue(kcp, ptr, end, &kcp->snd_queue, &kcp->nsnd_que);
+	ptr = ikcp_restore_queue(kcp, ptr, end, &kcp->snd_buf, &kcp->nsnd_buf);
+	if (ptr != NULL) {
+		struct IQUEUEHEAD *p;
+		for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
+			IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+			if (_itimediff(seg->sn, kcp->snd_una) < 0 || 
+				_itimediff(seg->sn, kcp->snd_nxt) >= 0 ||
+				ikcp_snd_ring_get(kcp, seg->sn) != NULL) {
+				ptr = NULL;
+				break;
+			}
+			ikcp_snd_ring_add(kcp, seg);
+			ikcp_snd_heap_push(kcp, seg);
+			ikcp_fast_candidate(kcp, seg);
+		}
+	}
+	iqueue_init(&rcv_buf);
+	ptr = ikcp_restore_queue(kcp, ptr, end, &rcv_buf, &nrcv_buf);
+	ptr = ikcp_restore_queue(kcp, ptr, end, &kcp->rcv_queue, &kcp->nrcv_que);
+	// out-of-order segments go back into the receive ring
+	if (ptr != NULL && nrcv_buf > 0 && ikcp_rcv_ring_resize(kcp) < 0)
+		ptr = NULL;
+	while (!iqueue_is_empty(&rcv_buf)) {
+		IKCPSEG *seg = iqueue_entry(rcv_buf.next, IKCPSEG, node);
+		iqueue_del(&seg->node);
+		if (ptr == NULL || _itimediff(seg->sn, kcp->rcv_nxt) < 0 ||
+			_itimediff(seg->sn, kcp->rcv_nxt + kcp->rcv_wnd) >= 0 ||
+			ikcp_rcv_ring_insert(kcp, seg) < 0)
+			ikcp_segment_delete(kcp, seg);
+	}
+	if (ptr == NULL) {
+		ikcp_release(kcp);
+		return NULL;
+	}
+	return kcp;
+}
+
 void ikcp_send_msg_check(const char *data, long size) {
 		IUINT32 ts, sn, len, una, conv;
 		IUINT16 wnd;
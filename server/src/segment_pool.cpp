@@ -0,0 +1,56 @@
+#include "../include/segment_pool.hpp"
+#include "../include/util.hpp"
+
+#include <new>
+#include <algorithm>
+
+namespace KCP {
+
+segment_pool::segment_pool() {
+    // 小块按 2 的幂分级，最后一级是满 MTU 的分片
+    for (size_t size = 64; size <= 1024; size <<= 1) {
+        class_sizes_.push_back(size);
+    }
+    class_sizes_.push_back(sizeof(IKCPSEG) + KCP_MTU - IKCP_OVERHEAD);
+    for (size_t size : class_sizes_) {
+        // 每页大约 64KB
+        classes_.emplace_back(new slab_pool(std::max<size_t>(16, (1 << 16) / size)));
+    }
+    allocator_.alloc = &segment_pool::allocHook;
+    allocator_.release = &segment_pool::releaseHook;
+    allocator_.ctx = this;
+}
+
+void* segment_pool::allocate(size_t size) {
+    int index = sizeClass(size);
+    if (index < 0)
+        return ::operator new(size, std::nothrow);
+    return classes_[index]->allocate(class_sizes_[index]);
+}
+
+void segment_pool::deallocate(void* ptr, size_t size) {
+    int index = sizeClass(size);
+    if (index < 0) {
+        ::operator delete(ptr);
+        return;
+    }
+    classes_[index]->deallocate(ptr, class_sizes_[index]);
+}
+
+int segment_pool::sizeClass(size_t size) const {
+    for (size_t i = 0; i < class_sizes_.size(); ++i) {
+        if (size <= class_sizes_[i])
+            return (int)i;
+    }
+    return -1;
+}
+
+void* segment_pool::allocHook(size_t size, void* ctx) {
+    return static_cast<segment_pool*>(ctx)->allocate(size);
+}
+
+void segment_pool::releaseHook(void* ptr, size_t size, void* ctx) {
+    static_cast<segment_pool*>(ctx)->deallocate(ptr, size);
+}
+
+};
@@ -0,0 +1,56 @@
+#include "../include/slab_pool.hpp"
+
+#include <new>
+
+namespace KCP {
+
+slab_pool::slab_pool(size_t blocks_per_page) : blocks_per_page_(blocks_per_page) {
+
+}
+
+slab_pool::~slab_pool() {
+    for (char* page : pages_) {
+        ::operator delete(page);
+    }
+}
+
+void* slab_pool::allocate(size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (block_size_ == 0) {
+        // 对齐到 max_align_t，保证每个块都能放任意对象
+        const size_t align = alignof(std::max_align_t);
+        block_size_ = (size + align - 1) / align * align;
+    }
+    if (size > block_size_) {
+        return ::operator new(size);
+    }
+    if (!free_list_) {
+        addPage();
+    }
+    void* block = free_list_;
+    free_list_ = *static_cast<void**>(block);
+    return block;
+}
+
+void slab_pool::deallocate(void* ptr, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (size > block_size_) {
+        ::operator delete(ptr);
+        return;
+    }
+    *static_cast<void**>(ptr) = free_list_;
+    free_list_ = ptr;
+}
+
+void slab_pool::addPage() {
+    char* page = static_cast<char*>(::operator new(block_size_ * blocks_per_page_));
+    pages_.push_back(page);
+    // 倒序入链表，分配时按地址递增取用
+    for (size_t i = blocks_per_page_; i > 0; --i) {
+        void* block = page + (i - 1) * block_size_;
+        *static_cast<void**>(block) = free_list_;
+        free_list_ = block;
+    }
+}
+
+};
@@ -1,23 +1,57 @@
 #include "../include/util.hpp"
 
-#include <iostream>
-#include <sstream>
+#include <cstring>
 
 namespace KCP {
 
-    bool isRequireConnect(const char* buffer, int len) {
-        return KCP_CONNECT_PACKET.compare(std::string(buffer, len));
+    eCtrlType getCtrlType(const char* buffer, int len) {
+        if (len < KCP_CTRL_HEAD_SIZE || decode32u(buffer) != 0)
+            return eCtrlNone;
+        unsigned char type = (unsigned char)buffer[4];
+        if (type <= eCtrlNone || type > eCtrlResume)
+            return eCtrlNone;
+        return (eCtrlType)type;
     }
 
-    std::string GenerateSendBackConvMsg(uint32_t conv) {
-        std::ostringstream ossm;
-        ossm << KCP_SEND_CONV_PACKET << conv;
-        return ossm.str();
+    int encodeCtrlPacket(char* buffer, eCtrlType type, const char* payload, int payload_len) {
+        encode32u(buffer, 0);
+        buffer[4] = (char)type;
+        if (payload_len > 0)
+            ::memcpy(buffer + KCP_CTRL_HEAD_SIZE, payload, payload_len);
+        return KCP_CTRL_HEAD_SIZE + payload_len;
     }
 
-    std::string GenerateDisconnectMsg(uint32_t conv) {
-        std::ostringstream ossm;
-        ossm << KCP_DISCONNECT_PACKET << conv;
-        return ossm.str();
+    int encodeCtrlPacket(char* buffer, eCtrlType type, uint32_t value) {
+        char payload[4];
+        encode32u(payload, value);
+        return encodeCtrlPacket(buffer, type, payload, sizeof(payload));
     }
-};
\ No newline at end of file
+
+    void encode32u(char* p, uint32_t value) {
+        p[0] = (char)(value & 0xff);
+        p[1] = (char)((value >> 8) & 0xff);
+        p[2] = (char)((value >> 16) & 0xff);
+        p[3] = (char)((value >> 24) & 0xff);
+    }
+
+    uint32_t decode32u(const char* p) {
+        const unsigned char* u = (const unsigned char*)p;
+        return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+    }
+
+    bool isKcpProbe(const char* buffer, int len) {
+        return len == (int)IKCP_OVERHEAD && buffer[4] == KCP_CMD_WASK;
+    }
+
+    int encodeKcpProbe(char* buffer, uint32_t conv, char cmd, uint32_t wnd, uint32_t ts, uint32_t una) {
+        // conv | cmd | frg | wnd(16) | ts | sn | una | len
+        ::memset(buffer, 0, IKCP_OVERHEAD);
+        encode32u(buffer, conv);
+        buffer[4] = cmd;
+        buffer[6] = (char)(wnd & 0xff);
+        buffer[7] = (char)((wnd >> 8) & 0xff);
+        encode32u(buffer + 8, ts);
+        encode32u(buffer + 16, una);
+        return IKCP_OVERHEAD;
+    }
+};